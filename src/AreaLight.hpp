@@ -21,6 +21,8 @@ namespace tk
 		AreaLight(int numSamples,
 			const Spectrum& Le, const std::shared_ptr<Shape>& shape, bool twoSided);
 		virtual Spectrum power()const;
+		const Shape* getShape()const { return shape.get(); }
+		bool isTwoSided()const { return twoSided; }
 
 		virtual Spectrum sample_Li(const Intersection& ref, Real u0, const Vector2f& u,
 			Intersection* it, Vector3f* wi, Real* pdf)const;
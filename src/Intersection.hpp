@@ -17,10 +17,11 @@ namespace tk
 		Vector3f wo;
 		Vector3f n;
 		const Object* obj;
+		const Shape* shape;	// primitive hit, the triangle for meshes
 		Intersection() {}
 		Intersection(const Vector3f& p, const Vector3f& n, const Vector2f& uv,
 			const Vector3f& pError, const Vector3f& wo)
-			: p(p), pError(pError), n(n), uv(uv), wo(wo) {}
+			: p(p), pError(pError), uv(uv), wo(wo), n(n) {}
 
 		Ray spawnRay(const Vector3f& dir)const
 		{
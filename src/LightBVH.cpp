@@ -0,0 +1,295 @@
+#include "LightBVH.hpp"
+#include "AreaLight.hpp"
+#include "Triangle.hpp"
+#include "Object.hpp"
+
+namespace tk
+{
+	static inline float safeSqrt(float x) { return std::sqrt(std::max(0.0f, x)); }
+	static inline float safeACos(float x) { return std::acos(Math::Clamp(x, -1.0f, 1.0f)); }
+
+	// cos(a - b) and sin(a - b), clamped to zero when a < b
+	static inline float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+	{
+		return cosA > cosB ? 1 : cosA * cosB + sinA * sinB;
+	}
+
+	static inline float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+	{
+		return cosA > cosB ? 0 : sinA * cosB - cosA * sinB;
+	}
+
+	// Rotates v by theta around the unit axis k
+	static Vector3f rotate(const Vector3f& v, const Vector3f& k, float theta)
+	{
+		float c = std::cos(theta), s = std::sin(theta);
+		return v * c + crossProduct(k, v) * s + k * (dotProduct(k, v) * (1 - c));
+	}
+
+	float LightBounds::importance(const Vector3f& p, const Vector3f& n)const
+	{
+		Vector3f pc = bounds.Centroid();
+		Vector3f d = p - pc;
+		float len2 = dotProduct(d, d);
+		float d2 = std::max<float>(len2, bounds.Diagonal().norm() / 2);
+		Vector3f wi = len2 > 0 ? d / std::sqrt(len2) : Vector3f(0, 0, 0);
+
+		float cosTheta_w = dotProduct(w, wi);
+		if (twoSided)
+			cosTheta_w = std::abs(cosTheta_w);
+		float sinTheta_w = safeSqrt(1 - cosTheta_w * cosTheta_w);
+
+		// Cone of directions from p that hit the bounding sphere of the bounds
+		Vector3f h = bounds.Diagonal() * 0.5f;
+		float r2 = dotProduct(h, h);
+		float cosTheta_b = len2 < r2 ? -1 : safeSqrt(1 - r2 / len2);
+		float sinTheta_b = safeSqrt(1 - cosTheta_b * cosTheta_b);
+
+		// Smallest angle between the normal cone and the direction to p, less the bounds' spread
+		float sinTheta_o = safeSqrt(1 - cosTheta_o * cosTheta_o);
+		float cosTheta_x = cosSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+		float sinTheta_x = sinSubClamped(sinTheta_w, cosTheta_w, sinTheta_o, cosTheta_o);
+		float cosThetap = cosSubClamped(sinTheta_x, cosTheta_x, sinTheta_b, cosTheta_b);
+		if (cosThetap <= cosTheta_e)
+			return 0;
+
+		float ret = phi * cosThetap / d2;
+		if (dotProduct(n, n) > 0)
+		{
+			float cosTheta_i = AbsDot(wi, n);
+			float sinTheta_i = safeSqrt(1 - cosTheta_i * cosTheta_i);
+			ret *= cosSubClamped(sinTheta_i, cosTheta_i, sinTheta_b, cosTheta_b);
+		}
+		return std::max(ret, 0.0f);
+	}
+
+	LightBounds Union(const LightBounds& a, const LightBounds& b)
+	{
+		if (a.phi == 0) return b;
+		if (b.phi == 0) return a;
+
+		// Smallest cone holding both normal cones
+		Vector3f w = a.w;
+		float cosTheta_o = -1;
+		float theta_a = safeACos(a.cosTheta_o), theta_b = safeACos(b.cosTheta_o);
+		float theta_d = safeACos(dotProduct(a.w, b.w));
+		if (std::min(theta_d + theta_b, Math::pi) <= theta_a)
+			cosTheta_o = a.cosTheta_o;
+		else if (std::min(theta_d + theta_a, Math::pi) <= theta_b)
+		{
+			w = b.w;
+			cosTheta_o = b.cosTheta_o;
+		}
+		else
+		{
+			float theta_o = (theta_a + theta_d + theta_b) / 2;
+			Vector3f wr = crossProduct(a.w, b.w);
+			if (theta_o < Math::pi && dotProduct(wr, wr) > 0)
+			{
+				w = rotate(a.w, normalize(wr), theta_o - theta_a);
+				cosTheta_o = std::cos(theta_o);
+			}
+		}
+		return LightBounds(Union(a.bounds, b.bounds), w, a.phi + b.phi, cosTheta_o,
+			std::min(a.cosTheta_e, b.cosTheta_e), a.twoSided || b.twoSided);
+	}
+
+	// Orientation-weighted surface area heuristic of Conty & Kulla
+	static float splitCost(const LightBounds& b, const Bounds3& bounds, s32 dim)
+	{
+		if (b.phi == 0)
+			return 0;
+		float theta_o = safeACos(b.cosTheta_o), theta_e = safeACos(b.cosTheta_e);
+		float theta_w = std::min(theta_o + theta_e, Math::pi);
+		float sinTheta_o = safeSqrt(1 - b.cosTheta_o * b.cosTheta_o);
+		float M_omega = Math::two_pi * (1 - b.cosTheta_o) +
+			Math::half_pi * (2 * theta_w * sinTheta_o - std::cos(theta_o - 2 * theta_w) -
+				2 * theta_o * sinTheta_o + b.cosTheta_o);
+		Vector3f d = bounds.Diagonal();
+		float Kr = std::max(d.x, std::max(d.y, d.z)) / d[dim];
+		return b.phi * M_omega * Kr * b.bounds.SurfaceArea();
+	}
+
+	LightBVH::LightBVH(const std::vector<std::shared_ptr<AreaLight>>& lights)
+	{
+		BuildVec prims;
+		for (const std::shared_ptr<AreaLight>& light : lights)
+		{
+			float power = light->power().illum();
+			const Shape* shape = light->getShape();
+			if (power <= 0 || shape->getArea() <= 0)
+				continue;
+			auto add = [&](const Shape* s) {
+				float phi = power * s->getArea() / shape->getArea();
+				if (phi <= 0)
+					return;
+				// Triangles emit around their normal, anything else is bounded by the whole sphere
+				const Triangle* tri = dynamic_cast<const Triangle*>(s);
+				LightBounds lb = tri ?
+					LightBounds(s->getBounds(), tri->normal, phi, 1, 0, light->isTwoSided()) :
+					LightBounds(s->getBounds(), Vector3f(0, 0, 1), phi, -1, 0, light->isTwoSided());
+				prims.emplace_back((s32)emitters.size(), lb);
+				emitters.push_back(Emitter{ light.get(), s });
+			};
+			if (const MeshTriangle* mesh = dynamic_cast<const MeshTriangle*>(shape))
+			{
+				for (const Object& tri : mesh->triangles)
+					add(tri.getShape());
+			}
+			else
+				add(shape);
+		}
+		if (prims.empty())
+			return;
+		nodes.reserve(2 * prims.size() - 1);
+		build(prims, 0, (s32)prims.size(), 0, 0);
+	}
+
+	s32 LightBVH::build(BuildVec& prims, s32 start, s32 end, u64 bitTrail, s32 depth)
+	{
+		s32 nodeIdx = (s32)nodes.size();
+		if (end - start == 1)
+		{
+			nodes.push_back(Node{ prims[start].second, prims[start].first, true });
+			trails[emitters[prims[start].first].shape] = bitTrail;
+			return nodeIdx;
+		}
+
+		Bounds3 bounds, centroidBounds;
+		for (s32 i = start; i < end; ++i)
+		{
+			bounds = Union(bounds, prims[i].second.bounds);
+			centroidBounds = Union(centroidBounds, prims[i].second.bounds.Centroid());
+		}
+
+		const s32 numBuckets = 12;
+		float minCost = Math::pos_infinity;
+		s32 minBucket = -1, minDim = -1;
+		// Past this depth fall back to median splits so the trail fits in 64 bits
+		if (depth < 48)
+		{
+			for (s32 dim = 0; dim < 3; ++dim)
+			{
+				if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim])
+					continue;
+				LightBounds buckets[numBuckets];
+				for (s32 i = start; i < end; ++i)
+				{
+					s32 b = (s32)(numBuckets * centroidBounds.Offset(prims[i].second.bounds.Centroid())[dim]);
+					b = std::min(b, numBuckets - 1);
+					buckets[b] = Union(buckets[b], prims[i].second);
+				}
+				for (s32 i = 0; i < numBuckets - 1; ++i)
+				{
+					LightBounds below, above;
+					for (s32 j = 0; j <= i; ++j)
+						below = Union(below, buckets[j]);
+					for (s32 j = i + 1; j < numBuckets; ++j)
+						above = Union(above, buckets[j]);
+					float cost = splitCost(below, bounds, dim) + splitCost(above, bounds, dim);
+					if (cost > 0 && cost < minCost)
+					{
+						minCost = cost;
+						minBucket = i;
+						minDim = dim;
+					}
+				}
+			}
+		}
+
+		s32 mid = (start + end) / 2;
+		if (minBucket != -1)
+		{
+			auto pmid = std::partition(prims.begin() + start, prims.begin() + end,
+				[&](const std::pair<s32, LightBounds>& l) {
+				s32 b = (s32)(numBuckets * centroidBounds.Offset(l.second.bounds.Centroid())[minDim]);
+				return std::min(b, numBuckets - 1) <= minBucket; });
+			mid = (s32)(pmid - prims.begin());
+			if (mid == start || mid == end)
+				mid = (start + end) / 2;
+		}
+		else
+		{
+			s32 dim = centroidBounds.maxExtent();
+			std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+				[dim](const std::pair<s32, LightBounds>& a, const std::pair<s32, LightBounds>& b) {
+				return a.second.bounds.Centroid()[dim] < b.second.bounds.Centroid()[dim]; });
+		}
+
+		nodes.push_back(Node{ LightBounds(), 0, false });
+		build(prims, start, mid, bitTrail, depth + 1);
+		s32 second = build(prims, mid, end, bitTrail | (1ull << depth), depth + 1);
+		nodes[nodeIdx].lb = Union(nodes[nodeIdx + 1].lb, nodes[second].lb);
+		nodes[nodeIdx].childOrEmitter = second;
+		return nodeIdx;
+	}
+
+	bool LightBVH::sample(const Vector3f& p, const Vector3f& n, Real u, Emitter* emitter, Real* pmf)const
+	{
+		if (nodes.empty())
+			return false;
+		s32 nodeIdx = 0;
+		*pmf = 1;
+		while (true)
+		{
+			const Node& node = nodes[nodeIdx];
+			if (node.isLeaf)
+			{
+				if (nodeIdx > 0 || node.lb.importance(p, n) > 0)
+				{
+					*emitter = emitters[node.childOrEmitter];
+					return true;
+				}
+				return false;
+			}
+			float c0 = nodes[nodeIdx + 1].lb.importance(p, n);
+			float c1 = nodes[node.childOrEmitter].lb.importance(p, n);
+			if (c0 == 0 && c1 == 0)
+				return false;
+			float p0 = c0 / (c0 + c1);
+			if (u < p0)
+			{
+				nodeIdx = nodeIdx + 1;
+				u = std::min(u / p0, Math::one_minus_epsilon);
+				*pmf *= p0;
+			}
+			else
+			{
+				nodeIdx = node.childOrEmitter;
+				u = std::min((u - p0) / (1 - p0), Math::one_minus_epsilon);
+				*pmf *= 1 - p0;
+			}
+		}
+	}
+
+	Real LightBVH::pmf(const Vector3f& p, const Vector3f& n, const Shape* shape)const
+	{
+		auto it = trails.find(shape);
+		if (it == trails.end())
+			return 0;
+		u64 trail = it->second;
+		s32 nodeIdx = 0;
+		Real ret = 1;
+		while (true)
+		{
+			const Node& node = nodes[nodeIdx];
+			if (node.isLeaf)
+				return nodeIdx > 0 || node.lb.importance(p, n) > 0 ? ret : 0;
+			float c0 = nodes[nodeIdx + 1].lb.importance(p, n);
+			float c1 = nodes[node.childOrEmitter].lb.importance(p, n);
+			if (c0 == 0 && c1 == 0)
+				return 0;
+			if (trail & 1)
+			{
+				ret *= c1 / (c0 + c1);
+				nodeIdx = node.childOrEmitter;
+			}
+			else
+			{
+				ret *= c0 / (c0 + c1);
+				nodeIdx = nodeIdx + 1;
+			}
+			trail >>= 1;
+		}
+	}
+}
\ No newline at end of file
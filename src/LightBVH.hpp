@@ -0,0 +1,67 @@
+#ifndef __Tk_LightBVH_H_
+#define __Tk_LightBVH_H_
+
+#include "TkPrerequisites.h"
+#include "Bounds3.hpp"
+#include <unordered_map>
+
+namespace tk
+{
+	// Bounds of the power emitted by a set of emitters: where it leaves from, the cone
+	// of their normals (axis w, spread theta_o) and the emission spread around a normal
+	struct LightBounds
+	{
+		Bounds3 bounds;
+		Vector3f w;
+		float phi = 0;
+		float cosTheta_o = 1, cosTheta_e = 0;
+		bool twoSided = false;
+
+		LightBounds() = default;
+		LightBounds(const Bounds3& bounds, const Vector3f& w, float phi,
+			float cosTheta_o, float cosTheta_e, bool twoSided)
+			: bounds(bounds), w(w), phi(phi), cosTheta_o(cosTheta_o), cosTheta_e(cosTheta_e), twoSided(twoSided) {}
+
+		// Conservative estimate of the power reaching p, n is the receiver normal or zero
+		float importance(const Vector3f& p, const Vector3f& n)const;
+	};
+
+	LightBounds Union(const LightBounds& a, const LightBounds& b);
+
+	// BVH over the emitting primitives (triangles of emissive meshes, spheres), picks one
+	// in proportion to its estimated contribution at a shading point
+	class LightBVH
+	{
+	public:
+		struct Emitter
+		{
+			const AreaLight* light;
+			const Shape* shape;
+		};
+
+		LightBVH(const std::vector<std::shared_ptr<AreaLight>>& lights);
+
+		// False if no emitter can contribute to p
+		bool sample(const Vector3f& p, const Vector3f& n, Real u, Emitter* emitter, Real* pmf)const;
+		// Probability of sample() picking shape at p
+		Real pmf(const Vector3f& p, const Vector3f& n, const Shape* shape)const;
+		size_t size()const { return emitters.size(); }
+
+	private:
+		struct Node
+		{
+			LightBounds lb;
+			s32 childOrEmitter;	// second child for interior nodes, the first one follows the node
+			bool isLeaf;
+		};
+		typedef std::vector<std::pair<s32, LightBounds>> BuildVec;
+
+		s32 build(BuildVec& prims, s32 start, s32 end, u64 bitTrail, s32 depth);
+
+		std::vector<Emitter> emitters;
+		std::vector<Node> nodes;
+		// Path from the root to each emitter, bit i is set when the second child is taken at depth i
+		std::unordered_map<const Shape*, u64> trails;
+	};
+}
+#endif
\ No newline at end of file
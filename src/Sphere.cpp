@@ -50,6 +50,7 @@ namespace tk
 		isect->pError = pError;
 		isect->wo = normalize(-r.direction);
 		isect->n = normalize(pHit - center);
+		isect->shape = this;
 		r.t_max = double(hit);
 		return true;
 
@@ -93,7 +94,17 @@ namespace tk
 
 	Intersection Sphere::Sample(const Intersection& target, float u0, const Vector2f& u, float* pdf)const
 	{
-		return Intersection();
+		Intersection ret = Sample(u, pdf);
+		Vector3f wi = ret.p - target.p;
+		float dist2 = dotProduct(wi, wi);
+		if (dist2 == 0)
+			*pdf = 0;
+		else
+		{
+			wi = normalize(wi);
+			*pdf *= dist2 / AbsDot(ret.n, -wi);
+		}
+		return ret;
 	}
 
 	void Sphere::draw(const Spectrum& c, Real alpha)const
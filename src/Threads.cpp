@@ -1,6 +1,7 @@
 #include "Threads.h"
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 
 namespace tk
 {
@@ -139,43 +140,97 @@ namespace tk
 		pthread_mutex_unlock(&mMutex);
 	}
 #endif
+	// A parallel loop split into chunks that any thread can claim with a single atomic increment
 	class ParallelJob
 	{
 	private:
 		friend class ThreadPool;
-		int activeWorkers = 0;
-		ParallelJob* prev = nullptr;
-		ParallelJob* next = nullptr;
-		bool removed = false;
+		std::atomic<s32> nextChunk;
+		std::atomic<s32> chunksDone;
+		std::atomic<s32> activeWorkers;
+		const s32 numChunks;
 	public:
+		explicit ParallelJob(s32 numChunks)
+			: nextChunk(0), chunksDone(0), activeWorkers(0), numChunks(numChunks) {}
 		virtual ~ParallelJob() {}
-		virtual bool haveWork(void)const = 0;
-		virtual void run(std::unique_lock<std::mutex>* lock) = 0;
-		bool finished(void)const { return !haveWork() && activeWorkers == 0; }
+		virtual void runChunk(s32 chunk) = 0;
+		bool haveWork()const { return nextChunk.load(std::memory_order_relaxed) < numChunks; }
+		bool finished()const { return chunksDone.load(std::memory_order_acquire) == numChunks; }
+		// Runs chunks until none are left to claim
+		void run()
+		{
+			s32 chunk;
+			while ((chunk = nextChunk.fetch_add(1, std::memory_order_relaxed)) < numChunks)
+			{
+				runChunk(chunk);
+				chunksDone.fetch_add(1, std::memory_order_release);
+			}
+		}
 	};
 
+	// Work-stealing scheduler: every worker owns a deque of jobs. The owner takes the most
+	// recently pushed (innermost) job from the back, idle threads steal from the front of the
+	// other deques. Threads waiting for a loop keep executing jobs, so loops can nest freely.
 	class ThreadPool
 	{
 	private:
+		struct WorkQueue
+		{
+			std::mutex mutex;
+			std::deque<ParallelJob*> jobs;
+		};
 		std::vector<std::thread> threads;
-		mutable std::mutex mutex;
-		bool shutdown = false;
-		ParallelJob* jobRoot = nullptr;
+		// One deque per worker plus a shared one for threads outside the pool
+		std::vector<std::unique_ptr<WorkQueue>> queues;
+		std::mutex sleepMutex;
 		std::condition_variable cv;
+		u64 workEpoch = 0;
+		bool shutdown = false;
 		void _workerFunc(int threadIdx);
+		s32 queueIndex()const;
+		ParallelJob* acquireJob(s32 queue, bool owner);
+		ParallelJob* findJob();
 	public:
-		explicit ThreadPool(int numThreads);
+		ThreadPool(int numThreads, bool pinThreads);
 		~ThreadPool();
 		size_t size()const { return threads.size(); }
-		std::unique_lock<std::mutex> addParrallelJob(ParallelJob* job);
-		void removeParallelJob(ParallelJob* job);
-		void workOrWait(std::unique_lock<std::mutex>* lock);
+		void addParrallelJob(ParallelJob* job);
+		void runUntilFinished(ParallelJob* job);
 	};
 
-	ThreadPool::ThreadPool(int numThreads)
+	static thread_local s32 workerIndex = -1;
+
+	static void pinThread(std::thread::native_handle_type handle, s32 threadIdx)
+	{
+		s32 numCores = std::max<s32>(1, std::thread::hardware_concurrency());
+#if (defined( __WIN32__ ) || defined( _WIN32 ))
+		SetThreadAffinityMask((HANDLE)handle, DWORD_PTR(1) << (threadIdx % numCores));
+#else
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(threadIdx % numCores, &cpuset);
+		pthread_setaffinity_np(handle, sizeof(cpu_set_t), &cpuset);
+#endif
+	}
+
+	ThreadPool::ThreadPool(int numThreads, bool pinThreads)
 	{
+		for (int i = 0; i < numThreads; ++i)
+			queues.push_back(std::make_unique<WorkQueue>());
 		for (int i = 1; i < numThreads; ++i)
+		{
 			threads.push_back(std::thread(&ThreadPool::_workerFunc, this, i));
+			if (pinThreads)
+				pinThread(threads.back().native_handle(), i);
+		}
+		if (pinThreads)
+		{
+#if (defined( __WIN32__ ) || defined( _WIN32 ))
+			pinThread(GetCurrentThread(), 0);
+#else
+			pinThread(pthread_self(), 0);
+#endif
+		}
 	}
 
 	ThreadPool::~ThreadPool()
@@ -183,7 +238,7 @@ namespace tk
 		if (threads.empty())
 			return;
 		{
-			std::lock_guard<std::mutex> lock(mutex);
+			std::lock_guard<std::mutex> lock(sleepMutex);
 			shutdown = true;
 			cv.notify_all();
 		}
@@ -192,52 +247,104 @@ namespace tk
 			thread.join();
 	}
 
-	void ThreadPool::_workerFunc(int threadIdx)
+	s32 ThreadPool::queueIndex()const
 	{
-		std::unique_lock<std::mutex> lock(mutex);
-		while (!shutdown)
-			workOrWait(&lock);
+		// Threads outside the pool share queue 0 with the thread that created it
+		return workerIndex >= 0 ? workerIndex : 0;
 	}
 
-	std::unique_lock<std::mutex> ThreadPool::addParrallelJob(ParallelJob* job)
+	ParallelJob* ThreadPool::acquireJob(s32 queue, bool owner)
 	{
-		std::unique_lock<std::mutex> lock(mutex);
-		if (jobRoot != nullptr)
-			jobRoot->prev = job;
-		job->next = jobRoot;
-		jobRoot = job;
-		cv.notify_all();
-		return lock;
+		WorkQueue& q = *queues[queue];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		while (!q.jobs.empty())
+		{
+			ParallelJob* job = owner ? q.jobs.back() : q.jobs.front();
+			if (job->haveWork())
+			{
+				// Registered under the queue lock so the job outlives this reference
+				job->activeWorkers.fetch_add(1, std::memory_order_relaxed);
+				return job;
+			}
+			if (owner)
+				q.jobs.pop_back();
+			else
+				q.jobs.pop_front();
+		}
+		return nullptr;
 	}
 
+	ParallelJob* ThreadPool::findJob()
+	{
+		s32 self = queueIndex();
+		ParallelJob* job = acquireJob(self, true);
+		s32 n = (s32)queues.size();
+		for (s32 i = 1; job == nullptr && i < n; ++i)
+			job = acquireJob((self + i) % n, false);
+		return job;
+	}
 
-	void ThreadPool::removeParallelJob(ParallelJob* job)
+	void ThreadPool::_workerFunc(int threadIdx)
 	{
-		if (job->prev != nullptr)
-			job->prev->next = job->next;
-		else
-			jobRoot = job->next;
-		if (job->next != nullptr)
-			job->next->prev = job->prev;
-		job->removed = true;
+		workerIndex = threadIdx;
+		while (true)
+		{
+			u64 epoch;
+			{
+				std::lock_guard<std::mutex> lock(sleepMutex);
+				if (shutdown)
+					break;
+				epoch = workEpoch;
+			}
+			ParallelJob* job = findJob();
+			if (job != nullptr)
+			{
+				job->run();
+				job->activeWorkers.fetch_sub(1, std::memory_order_release);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			cv.wait(lock, [&]() { return shutdown || workEpoch != epoch; });
+		}
 	}
 
-	void ThreadPool::workOrWait(std::unique_lock<std::mutex>* lock)
+	void ThreadPool::addParrallelJob(ParallelJob* job)
 	{
-		ParallelJob* job = jobRoot;
-		while ((job != nullptr) && !job->haveWork())
-			job = job->next;
-		if (job != nullptr)
+		WorkQueue& q = *queues[queueIndex()];
 		{
-			job->activeWorkers++;
-			job->run(lock);
-			lock->lock();
-			job->activeWorkers--;
-			if (job->finished())
-				cv.notify_all();
+			std::lock_guard<std::mutex> lock(q.mutex);
+			q.jobs.push_back(job);
 		}
-		else
-			cv.wait(*lock);
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		++workEpoch;
+		cv.notify_all();
+	}
+
+	void ThreadPool::runUntilFinished(ParallelJob* job)
+	{
+		job->run();
+		// Help with other work (possibly nested inside our own chunks) while the rest finishes
+		while (!job->finished())
+		{
+			ParallelJob* other = findJob();
+			if (other != nullptr)
+			{
+				other->run();
+				other->activeWorkers.fetch_sub(1, std::memory_order_release);
+			}
+			else
+				std::this_thread::yield();
+		}
+		WorkQueue& q = *queues[queueIndex()];
+		{
+			std::lock_guard<std::mutex> lock(q.mutex);
+			std::deque<ParallelJob*>::iterator it = std::find(q.jobs.begin(), q.jobs.end(), job);
+			if (it != q.jobs.end())
+				q.jobs.erase(it);
+		}
+		// Thieves may still hold the job while finding it exhausted
+		while (job->activeWorkers.load(std::memory_order_acquire) > 0)
+			std::this_thread::yield();
 	}
 
 	static std::unique_ptr<ThreadPool> threadPool;
@@ -245,102 +352,124 @@ namespace tk
 	class ParallelForLoop1D : public ParallelJob
 	{
 	private:
-		std::function<void(int, int)> func;
-		int nextIdx, endIdx;
-		int chunkSize;
+		std::function<void(s32, s32)> func;
+		s32 startIdx, endIdx;
+		s32 chunkSize;
 	public:
-		ParallelForLoop1D(int startIdx, int endIdx, int chunkSize, std::function<void(int, int)> func)
-			: func(std::move(func)),
-			nextIdx(startIdx),
+		ParallelForLoop1D(s32 startIdx, s32 endIdx, s32 chunkSize, std::function<void(s32, s32)> func)
+			: ParallelJob((endIdx - startIdx + chunkSize - 1) / chunkSize),
+			func(std::move(func)),
+			startIdx(startIdx),
 			endIdx(endIdx),
 			chunkSize(chunkSize) {}
 
-		bool haveWork()const { return nextIdx < endIdx; }
-		void run(std::unique_lock<std::mutex>* lock);
+		void runChunk(s32 chunk)
+		{
+			s32 start = startIdx + chunk * chunkSize;
+			func(start, std::min(start + chunkSize, endIdx));
+		}
 	};
 
-	void ParallelForLoop1D::run(std::unique_lock<std::mutex>* lock)
-	{
-		int start = nextIdx;
-		int end = std::min(start + chunkSize, endIdx);
-		nextIdx = end;
-
-		if (!haveWork())
-			threadPool->removeParallelJob(this);
-		lock->unlock();
-		func(start, end);
-	}
-
 	class ParallelForLoop2D : public ParallelJob
 	{
 	private:
 		std::function<void(Bounds2i)> func;
 		const Bounds2i extent;
-		Point2i nextStart;
-		int chunkSize;
+		s32 chunkSize;
+		s32 numX;
 	public:
-		ParallelForLoop2D(const Bounds2i& extent, int chunkSize, std::function<void(Bounds2i)> func)
-			: func(std::move(func)),
+		ParallelForLoop2D(const Bounds2i& extent, s32 chunkSize, s32 numX, s32 numY, std::function<void(Bounds2i)> func)
+			: ParallelJob(numX * numY),
+			func(std::move(func)),
 			extent(extent),
-			nextStart(extent.pMin),
-			chunkSize(chunkSize) {}
+			chunkSize(chunkSize),
+			numX(numX) {}
 
-		bool haveWork()const { return nextStart.y < extent.pMax.y; }
-		void run(std::unique_lock<std::mutex>* lock);
+		void runChunk(s32 chunk)
+		{
+			Point2i start = extent.pMin + Point2i(chunk % numX * chunkSize, chunk / numX * chunkSize);
+			Bounds2i b(start, start + Point2i(chunkSize, chunkSize));
+			b.intersect(extent);
+			func(b);
+		}
 	};
 
-	void ParallelForLoop2D::run(std::unique_lock<std::mutex>* lock)
+	void Parrallel::parrallelFor(s32 start, s32 end, std::function<void(s32, s32)> func)
 	{
-		Point2i end = nextStart + Point2i(chunkSize, chunkSize);
-		Bounds2i b(nextStart, end);
-		b.intersect(extent);
-		nextStart.x += chunkSize;
-		if (nextStart.x >= extent.pMax.x)
+		if (end <= start)
+			return;
+		int runThreads = threadPool ? threadPool->size() + 1 : 1;
+		int chunkSize = std::max<int>(1, (end - start) / (8 * runThreads));
+		if (runThreads == 1 || end - start <= chunkSize)
 		{
-			nextStart.x = extent.pMin.x;
-			nextStart.y += chunkSize;
+			func(start, end);
+			return;
 		}
 
-		if (!haveWork())
-			threadPool->removeParallelJob(this);
-		lock->unlock();
-		func(b);
+		ParallelForLoop1D loop(start, end, chunkSize, std::move(func));
+		threadPool->addParrallelJob(&loop);
+		threadPool->runUntilFinished(&loop);
 	}
 
-	void Parrallel::parrallelFor(s32 start, s32 end, std::function<void(s32, s32)> func)
+	void Parrallel::parrallelFor2D(const Bounds2i& extent, std::function<void(Bounds2i)> func)
 	{
-		int runThreads = threadPool->size() + 1;
-		int chunkSize = std::max<int>(1, (end - start) / (8 * runThreads));
-		if (end - start < chunkSize)
+		Point2i diag = extent.diagonal();
+		if (diag.x <= 0 || diag.y <= 0)
+			return;
+		int runThreads = threadPool ? threadPool->size() + 1 : 1;
+		if (runThreads == 1)
 		{
-			func(start, end);
+			func(extent);
 			return;
 		}
+		int tileSize = Math::Clamp(int(sqrt(diag.x * diag.y / (8 * runThreads))), 1, 32);
+		ParallelForLoop2D loop(extent, tileSize, (diag.x + tileSize - 1) / tileSize,
+			(diag.y + tileSize - 1) / tileSize, std::move(func));
+		threadPool->addParrallelJob(&loop);
+		threadPool->runUntilFinished(&loop);
+	}
 
-		ParallelForLoop1D loop(start, end, chunkSize, std::move(func));
+	class ParallelTasks : public ParallelJob
+	{
+	private:
+		std::function<void(s32)> func;
+	public:
+		ParallelTasks(s32 count, std::function<void(s32)> func)
+			: ParallelJob(count), func(std::move(func)) {}
 
-		std::unique_lock<std::mutex> lock = threadPool->addParrallelJob(&loop);
+		void runChunk(s32 chunk) { func(chunk); }
+	};
 
-		while (!loop.finished())
-			threadPool->workOrWait(&lock);
+	std::shared_ptr<ParallelJob> Parrallel::parrallelAsync(s32 count, std::function<void(s32)> func)
+	{
+		std::shared_ptr<ParallelJob> job = std::make_shared<ParallelTasks>(count, std::move(func));
+		// Without a pool the tasks run when the caller waits for them
+		if (threadPool)
+			threadPool->addParrallelJob(job.get());
+		return job;
 	}
 
-	void Parrallel::parrallelFor2D(const Bounds2i& extent, std::function<void(Bounds2i)> func)
+	void Parrallel::parrallelWait(const std::shared_ptr<ParallelJob>& job)
 	{
-		int runThreads = threadPool->size() + 1;
-		int tileSize = Math::Clamp(int(sqrt(extent.diagonal().x * extent.diagonal().y /
-			(8 * runThreads))), 1, 32);
-		ParallelForLoop2D loop(extent, tileSize, std::move(func));
-		std::unique_lock<std::mutex> lock = threadPool->addParrallelJob(&loop);
-		while (!loop.finished())
-			threadPool->workOrWait(&lock);
+		if (!job)
+			return;
+		if (threadPool)
+			threadPool->runUntilFinished(job.get());
+		else
+			job->run();
 	}
 
-	void Parrallel::parrallelInit(s32 numThreads)
+	void Parrallel::parrallelInit(s32 numThreads, bool pinThreads)
 	{
 		if (numThreads <= 0)
 			numThreads = std::max<s32>(1, std::thread::hardware_concurrency());
-		threadPool = std::make_unique<ThreadPool>(numThreads);
+		threadPool.reset();
+		threadPool = std::make_unique<ThreadPool>(numThreads, pinThreads);
+	}
+
+	s32 Parrallel::parrallelThreads()
+	{
+		return threadPool ? (s32)threadPool->size() + 1 : 1;
 	}
 
 }
\ No newline at end of file
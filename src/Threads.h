@@ -98,12 +98,22 @@ unsigned long __stdcall func##_internal(void* argName)\
 		void lock();
 		void unlock();
 	};
+	class ParallelJob;
+
 	class Parrallel
 	{
 	public:
 		static void parrallelFor(s32 start, s32 end, std::function<void(s32, s32)> func);
 		static void parrallelFor2D(const Bounds2i& extent, std::function<void(Bounds2i)> func);
-		static void parrallelInit(s32 numThreads);
+		// Runs func(i) for i in [0, count) on the pool workers without blocking the caller,
+		// the same thread must call parrallelWait on the returned job
+		static std::shared_ptr<ParallelJob> parrallelAsync(s32 count, std::function<void(s32)> func);
+		static void parrallelWait(const std::shared_ptr<ParallelJob>& job);
+		// Creates the shared pool, numThreads <= 0 uses the hardware concurrency. The calling
+		// thread counts as one of the threads, with pinThreads every thread is bound to a core.
+		static void parrallelInit(s32 numThreads, bool pinThreads = false);
+		// Number of threads taking part in parallel work, including the caller
+		static s32 parrallelThreads();
 	};
 }
 #endif
\ No newline at end of file
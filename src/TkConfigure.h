@@ -34,6 +34,14 @@ namespace tk
 		s32 causticSize;
 		s32 causticSample;
 		Real radius2;
+		// Traces the next iteration's photons while the current one is gathered
+		s32 pipeline;
+		// Precomputes irradiance at every nth global photon for the final gather, 0 disables
+		s32 irradiance;
+		// Steers photon emission towards what the camera sees
+		s32 importance;
+		// Emits caustic photons only towards mirrors and glass
+		s32 projection;
 	};
 
 	struct Config
@@ -40,16 +40,22 @@ namespace tk
 		switch (len & 7) {
 		case 7:
 			h ^= u64(data2[6]) << 48;
+			// fall through
 		case 6:
 			h ^= u64(data2[5]) << 40;
+			// fall through
 		case 5:
 			h ^= u64(data2[4]) << 32;
+			// fall through
 		case 4:
 			h ^= u64(data2[3]) << 24;
+			// fall through
 		case 3:
 			h ^= u64(data2[2]) << 16;
+			// fall through
 		case 2:
 			h ^= u64(data2[1]) << 8;
+			// fall through
 		case 1:
 			h ^= u64(data2[0]);
 			h *= m;
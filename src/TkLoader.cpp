@@ -10,7 +10,8 @@
 #include "tracer/TkSppmTracer.h"
 #include "tracer/TkPathTracer.h"
 #include "tracer/TkLightTracer.h"
-//#include "TkSPPM.h"
+#include "tracer/TkSPPM.h"
+#include "sampler.h"
 
 #include "tinyxml.h"
 
@@ -54,6 +55,7 @@ namespace tk
 	static const char STR_DEPTH[] = "depth";
 	static const char STR_ROULETTE[] = "roulete";
 	static const char STR_THREAD[] = "thread";
+	static const char STR_SAMPLER[] = "sampler";
 
 	static void print_error_header(const TiXmlElement* base)
 	{
@@ -225,18 +227,108 @@ namespace tk
 		camera->r = tmp.z;
 	}
 
+	static Sampler* parse_sampler(const TiXmlElement* elem, s32 spp, const Config* config)
+	{
+		string type;
+		parse_attrib_string(elem, true, STR_TYPE, &type);
+		if (type == "sobol")
+		{
+			string scramble = "owen";
+			s32 seed = 0;
+			parse_attrib_string(elem, false, "scramble", &scramble);
+			parse_attrib_int(elem, false, "seed", &seed);
+			SobolSampler::eScramble mode = SobolSampler::OWEN;
+			if (scramble == "none")
+				mode = SobolSampler::NONE;
+			else if (scramble == "xor")
+				mode = SobolSampler::XOR;
+			return new SobolSampler(spp, mode, seed);
+		}
+		else if (type == "halton")
+		{
+			string scramble = "permute";
+			s32 seed = 0;
+			parse_attrib_string(elem, false, "scramble", &scramble);
+			parse_attrib_int(elem, false, "seed", &seed);
+			return new HaltonSampler(spp, Point2i(config->width, config->height), seed, scramble != "none");
+		}
+		else if (type == "stratified")
+		{
+			s32 dims = 0, seed = 0, jitter = 1;
+			parse_attrib_int(elem, false, "dims", &dims);
+			parse_attrib_int(elem, false, "seed", &seed);
+			parse_attrib_int(elem, false, "jitter", &jitter);
+			s32 y = (s32)std::sqrt((Real)spp);
+			while (spp % y)
+				--y;
+			return new StratifiedSampler(spp / y, y, jitter != 0, seed, dims);
+		}
+		print_error_header(elem);
+		std::cout << "No such sampler '" << type << "'.\n";
+		throw std::exception();
+	}
+
+	static u64 hash_bytes(u64 hash, const void* data, size_t size)
+	{
+		// FNV-1a
+		const u8* p = (const u8*)data;
+		for (size_t i = 0; i < size; ++i)
+			hash = (hash ^ p[i]) * 0x100000001b3ULL;
+		return hash;
+	}
+
+	// Hashes what the light transport depends on: materials, meshes with their files,
+	// lights and objects. The camera, tracer and image size are left out.
+	static u64 hash_scene_content(const TiXmlElement* root)
+	{
+		u64 hash = 0xcbf29ce484222325ULL;
+		const char* names[] = { STR_MATERIAL, STR_MESH, STR_LIGHT, STR_OBJECT };
+		for (const char* name : names)
+		{
+			for (const TiXmlElement* elem = root->FirstChildElement(name); elem;
+				elem = elem->NextSiblingElement(name))
+			{
+				TiXmlPrinter printer;
+				elem->Accept(&printer);
+				hash = hash_bytes(hash, printer.CStr(), printer.Size());
+				const char* filename = elem->Attribute(STR_FILENAME);
+				FILE* fp = filename ? fopen(filename, "rb") : nullptr;
+				if (!fp)
+					continue;
+				char buffer[1 << 16];
+				size_t n;
+				while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+					hash = hash_bytes(hash, buffer, n);
+				fclose(fp);
+			}
+		}
+		return hash;
+	}
+
 	static void parse_tracer(const TiXmlElement* elem, Config* config)
 	{
 		string type;
 		parse_attrib_string(elem, true, STR_TYPE, &type);
-		s32 spp = 16, maxDepth = 32, numThreads = 4;
+		s32 spp = 16, maxDepth = 32, numThreads = 0;
 		Real russianRoulette = 0.8;
 		parse_elem(elem, false, STR_SPP, &spp);
 		parse_elem(elem, false, STR_DEPTH, &maxDepth);
 		parse_elem(elem, false, STR_ROULETTE, &russianRoulette);
 		parse_elem(elem, false, STR_THREAD, &numThreads);
+		// <thread i="0" affinity="1"/>, 0 threads (the default without <thread>) uses the
+		// hardware concurrency. The same pool runs the BVH build, photon tracing and tile rendering.
+		s32 affinity = 0;
+		const TiXmlElement* threadElem = get_unique_child(elem, false, STR_THREAD);
+		if (threadElem)
+			parse_attrib_int(threadElem, false, "affinity", &affinity);
+		Parrallel::parrallelInit(numThreads, affinity != 0);
 		if (type == "pt")
-			config->tracer = new PathTracer(spp, maxDepth, numThreads, russianRoulette);
+		{
+			// <lsamples i="4"/> light samples at the first vertex
+			s32 lightSamples = 1;
+			parse_elem(elem, false, "lsamples", &lightSamples);
+			config->tracer = new PathTracer(spp, maxDepth, russianRoulette, lightSamples);
+		}
 		else if (type == "sppm")
 		{
 			SPPMParam param;
@@ -246,8 +338,33 @@ namespace tk
 			parse_elem(elem, true, "csize", &param.causticSize);
 			parse_elem(elem, true, "csample", &param.causticSample);
 			parse_elem(elem, true, STR_RADIUS, &param.radius2);
-			config->tracer = new SppmTracer(spp, maxDepth, numThreads, russianRoulette, param);
-			//config->tracer = new SPPM(spp, maxDepth, numThreads, russianRoulette, param);
+			param.pipeline = 0;
+			parse_elem(elem, false, "pipeline", &param.pipeline);
+			param.irradiance = 0;
+			parse_elem(elem, false, "irradiance", &param.irradiance);
+			param.importance = 0;
+			parse_elem(elem, false, "importance", &param.importance);
+			param.projection = 0;
+			parse_elem(elem, false, "projection", &param.projection);
+			SppmTracer* tracer = new SppmTracer(spp, maxDepth, russianRoulette, param);
+			// <photon_cache filename="scene.photons"/>
+			const TiXmlElement* cacheElem = get_unique_child(elem, false, "photon_cache");
+			if (cacheElem)
+			{
+				string cacheFile;
+				parse_attrib_string(cacheElem, true, STR_FILENAME, &cacheFile);
+				tracer->setPhotonCache(cacheFile, hash_scene_content(elem->Parent()->ToElement()));
+			}
+			config->tracer = tracer;
+		}
+		else if (type == "hashsppm")
+		{
+			// Photons are gathered at the visible points, gsize is the photon count per iteration
+			SPPMParam param;
+			parse_elem(elem, true, "recurse", &param.numRecurse);
+			parse_elem(elem, true, "gsize", &param.globalSize);
+			parse_elem(elem, true, STR_RADIUS, &param.radius2);
+			config->tracer = new SPPM(spp, maxDepth, russianRoulette, param);
 		}
 		else if (type == "bdpt")
 		{
@@ -255,11 +372,66 @@ namespace tk
 			parse_elem(elem, false, "debug_s", &debug_s);
 			parse_elem(elem, false, "debug_t", &debug_t);
 			parse_elem(elem, false, "debug_no_mis", &noMis);
-			config->tracer = new BdptTracer(spp, maxDepth, numThreads, russianRoulette,
+			config->tracer = new BdptTracer(spp, maxDepth, russianRoulette,
 				debug_s, debug_t, noMis);
 		}
 		else if (type == "light")
-			config->tracer = new LightTracer(spp, maxDepth, numThreads, russianRoulette);
+			config->tracer = new LightTracer(spp, maxDepth, russianRoulette);
+
+		const TiXmlElement* child = get_unique_child(elem, false, STR_SAMPLER);
+		if (child && config->tracer)
+		{
+			Sampler* sampler = parse_sampler(child, config->tracer->getSampler()->getSamplesPerPixel(), config);
+			if (sampler)
+				config->tracer->setSampler(sampler);
+		}
+
+		// <adaptive threshold="0.02" min_spp="8"/>, spp stays the per pixel maximum
+		child = get_unique_child(elem, false, "adaptive");
+		if (child && config->tracer)
+		{
+			Real threshold = 0;
+			s32 minSpp = 8;
+			parse_attrib_real(child, true, "threshold", &threshold);
+			parse_attrib_int(child, false, "min_spp", &minSpp);
+			config->tracer->setAdaptive(threshold, minSpp);
+		}
+
+		// <tiles size="20" order="rowmajor|hilbert|spiral" pilot="1"/>, with a pilot pass the
+		// remaining samples are scheduled by the measured tile costs
+		child = get_unique_child(elem, false, "tiles");
+		if (child && config->tracer)
+		{
+			s32 size = 20, pilot = 0;
+			string order = "rowmajor";
+			parse_attrib_int(child, false, "size", &size);
+			parse_attrib_int(child, false, "pilot", &pilot);
+			parse_attrib_string(child, false, "order", &order);
+			eTileOrder tileOrder = TILE_ROWMAJOR;
+			if (order == "hilbert")
+				tileOrder = TILE_HILBERT;
+			else if (order == "spiral")
+				tileOrder = TILE_SPIRAL;
+			else if (order != "rowmajor")
+			{
+				print_error_header(child);
+				std::cout << "No such tile order '" << order << "'.\n";
+				throw std::exception();
+			}
+			config->tracer->setTiles(size, tileOrder, pilot);
+		}
+
+		// <progressive pass_spp="4" time="600" noise="0.01"/>, spp is the total budget
+		child = get_unique_child(elem, false, "progressive");
+		if (child && config->tracer)
+		{
+			s32 passSpp = 4;
+			Real time = 0, noise = 0;
+			parse_attrib_int(child, false, "pass_spp", &passSpp);
+			parse_attrib_real(child, false, "time", &time);
+			parse_attrib_real(child, false, "noise", &noise);
+			config->tracer->setProgressive(std::max(passSpp, 1), time, noise);
+		}
 	}
 
 	template< typename T >
@@ -446,7 +618,8 @@ namespace tk
 				config->scene->Add(obj);
 				elem = elem->NextSiblingElement(STR_OBJECT);
 			}
-			config->scene->buildBVH();		
+			config->scene->buildBVH();
+			config->scene->buildLightDistribution();
 		}
 		catch(std::bad_alloc const&)
 		{
@@ -65,6 +65,7 @@ namespace tk
 #include <bitset>
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
 #include <limits>
 
@@ -114,6 +115,7 @@ namespace tk
 	class Camera;
 	class AreaLight;
 	class BVHAccel;
+	class LightBVH;
 
 	class Viewer;
 	class Renderer;
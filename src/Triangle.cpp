@@ -45,6 +45,7 @@ namespace tk
 			isect->uv = t0 * w + t1 * u + t2 * v;
 			isect->wo = normalize(-r.direction);
 			isect->n = normal;
+			isect->shape = this;
 			r.t_max = t_tmp;
 			return true;
 		}
@@ -189,9 +190,11 @@ namespace tk
 
 	Intersection MeshTriangle::Sample(const Vector2f& sample, float* pdf)const
 	{
-		int idx = distribution.sampleDiscrete(get_random_float(), pdf);
+		int idx = distribution.sampleDiscrete(sample.x, pdf);
+		// The first dimension picks the triangle and is remapped to [0, 1) within it
+		Vector2f u(*pdf > 0 ? std::min((sample.x - distribution.cdf[idx]) / *pdf, Math::one_minus_epsilon) : 0, sample.y);
 		float tmp;
-		Intersection ret = triangles[idx].getShape()->Sample(sample, &tmp);
+		Intersection ret = triangles[idx].getShape()->Sample(u, &tmp);
 		*pdf *= tmp;
 		return ret;
 	}
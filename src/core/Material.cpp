@@ -7,6 +7,8 @@
 
 namespace tk
 {
+	thread_local eTransportMode Material::m_mode = Radiance;
+
 	Material::Material(MaterialType t)
 		: m_volume(nullptr)
 	{
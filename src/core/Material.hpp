@@ -62,7 +62,8 @@ namespace tk
 	public:
 		MaterialType m_type;
 		Volume* m_volume;
-		mutable eTransportMode m_mode;
+		// Per thread, pipelined SPPM traces photons and camera paths at the same time
+		static thread_local eTransportMode m_mode;
 		bool isDelta;
 
 		Material(MaterialType t = DIFFUSE);
@@ -7,6 +7,7 @@
 #include "sampler.h"
 #include "Material.hpp"
 #include "Intersection.hpp"
+#include "Shape.h"
 
 namespace tk
 {
@@ -19,6 +20,41 @@ namespace tk
 		this->bvh = std::unique_ptr<BVHAccel>(new BVHAccel(objects, 1));
 	}
 
+	void Scene::buildLightDistribution()
+	{
+		std::vector<float> power(lights.size());
+		float total = 0;
+		lightIndices.clear();
+		for (size_t i = 0; i < lights.size(); ++i)
+		{
+			power[i] = std::max<float>(lights[i]->power().illum(), 0);
+			total += power[i];
+			lightIndices[lights[i].get()] = (s32)i;
+		}
+		// Lights without power would never be picked, fall back to uniform then
+		if (total <= 0)
+			std::fill(power.begin(), power.end(), 1.0f);
+		if (!lights.empty())
+			lightDistribution = Distribution1D(power.data(), (int)power.size());
+		lightBVH.reset(new LightBVH(lights));
+	}
+
+	s32 Scene::sampleLight(Real u, Real* pdf)const
+	{
+		float p;
+		s32 idx = lightDistribution.sampleDiscrete(u, &p);
+		*pdf = p;
+		return idx;
+	}
+
+	Real Scene::lightPdf(const AreaLight* light)const
+	{
+		auto it = lightIndices.find(light);
+		if (it == lightIndices.end())
+			return 0;
+		return lightDistribution.cdf[it->second + 1] - lightDistribution.cdf[it->second];
+	}
+
 	bool Scene::intersect(const Ray &r, Intersection* isect)const
 	{
 		return this->bvh->intersect(r, isect);
@@ -38,25 +74,57 @@ namespace tk
 			delete *it++;
 		objects.clear();
 		lights.clear();
+		// Both keep raw pointers to the lights and shapes just released
+		lightBVH.reset();
+		lightIndices.clear();
+		lightDistribution = Distribution1D();
 	}
 
-	Spectrum Scene::uniformSampleOneLight(const Intersection& it, Sampler& sampler)const
+	Spectrum Scene::sampleOneLight(const Intersection& it, Sampler& sampler, bool mis)const
 	{
-		s32 numLights = lights.size();
-		if (numLights == 0) return Spectrum::black;
-
-		s32 idx = std::min<s32>(sampler.get1D() * numLights, numLights - 1);
-		Real pdfChoice = 1.0f / numLights;
+		if (!lightBVH) return Spectrum::black;
 
-		const std::shared_ptr<AreaLight>& l = lights[idx];
+		Real u = sampler.get1D();
 		Vector2f uLight = sampler.get2D();
-		Vector3f ws;
+		Real u0 = sampler.get1D();
+		return sampleOneLight(it, u, uLight, u0, mis);
+	}
+
+	Spectrum Scene::sampleOneLight(const Intersection& it, Real uChoice, const Vector2f& uLight, Real u0, bool mis)const
+	{
+		if (!lightBVH) return Spectrum::black;
+
+		LightBVH::Emitter emitter;
+		Real pmf;
+		if (!lightBVH->sample(it.p, it.n, uChoice, &emitter, &pmf))
+			return Spectrum::black;
+
 		Real pdfLight;
-		Intersection isect;
-		Spectrum Li = l->sample_Li(it, sampler.get1D(), uLight, &isect, &ws, &pdfLight);
+		Intersection isect = emitter.shape->Sample(it, u0, uLight, &pdfLight);
+		Vector3f ws = isect.p - it.p;
+		if (pdfLight == 0 || dotProduct(ws, ws) == 0)
+			return Spectrum::black;
+		ws = normalize(ws);
+		Spectrum Li = emitter.light->L(isect, -ws);
 		if (Li == Spectrum::black || intersectP(it.spawnRayTo(isect)))
 			return Spectrum::black;
 		const Material* m = it.obj->getMaterial();
-		return Li * m->f(it.wo, ws, it.n) * AbsDot(ws, it.n) / (pdfLight * pdfChoice);
+		Real pdf = pdfLight * pmf;
+		Real weight = mis ? powerHeuristic(1, pdf, 1, std::max<Real>(m->Pdf(it.wo, ws, it.n), 0)) : 1;
+		return Li * m->f(it.wo, ws, it.n) * AbsDot(ws, it.n) * weight / pdf;
+	}
+
+	Real Scene::pdfLi(const Intersection& ref, const Intersection& lightIsect)const
+	{
+		if (!lightBVH) return 0;
+		Real pmf = lightBVH->pmf(ref.p, ref.n, lightIsect.shape);
+		Vector3f wi = lightIsect.p - ref.p;
+		Real dist2 = dotProduct(wi, wi);
+		if (pmf == 0 || dist2 == 0)
+			return 0;
+		Real cosTheta = AbsDot(lightIsect.n, wi) / std::sqrt(dist2);
+		if (cosTheta == 0)
+			return 0;
+		return pmf * lightIsect.shape->Pdf(lightIsect) * dist2 / cosTheta;
 	}
 }
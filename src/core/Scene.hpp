@@ -6,6 +6,9 @@
 
 #include "AreaLight.hpp"
 #include "BVH.hpp"
+#include "LightBVH.hpp"
+#include "sampling.h"
+#include <unordered_map>
 
 namespace tk
 {
@@ -18,6 +21,11 @@ namespace tk
 		std::unique_ptr<BVHAccel> bvh;
 		ObjectPtrVec objects;
 		SharedLightVec lights;
+		// Lights in proportion to their power, for the tracers that start paths on lights
+		Distribution1D lightDistribution;
+		std::unordered_map<const AreaLight*, s32> lightIndices;
+		// Emitting primitives by their contribution at a point, for next-event estimation
+		std::unique_ptr<LightBVH> lightBVH;
 	public:
 		Scene(){}
 		~Scene();
@@ -31,8 +39,16 @@ namespace tk
 		bool intersectP(const Ray& r)const;
 		void reset();	
 		void buildBVH();
+		// Builds the light distribution and the light BVH, call once all lights are added
+		void buildLightDistribution();
+		s32 sampleLight(Real u, Real* pdf)const;
+		Real lightPdf(const AreaLight* light)const;
 		BVHAccel* getBVH()const { return bvh.get(); }
-		Spectrum uniformSampleOneLight(const Intersection& it, Sampler& sampler)const;
+		// Direct lighting from one emitter picked by the light BVH, weighted against
+		// BSDF sampling with the power heuristic when mis is set
+		Spectrum sampleOneLight(const Intersection& it, Sampler& sampler, bool mis = false)const;
+		Spectrum sampleOneLight(const Intersection& it, Real uChoice, const Vector2f& uLight, Real u0, bool mis = false)const;
+		// Solid angle density of sampleOneLight() from ref picking the point lightIsect
+		Real pdfLi(const Intersection& ref, const Intersection& lightIsect)const;
 	};
 }
-
@@ -1,18 +1,62 @@
 #include "TkFilm.h"
-
+#include "Threads.h"
 
 namespace tk
 {
+	// FilmTile storage is recycled per thread, a tile is normally created and merged
+	// by the thread that traces it
+	template<class T>
+	static std::vector<std::vector<T>>& tileStoragePool()
+	{
+		static thread_local std::vector<std::vector<T>> pool;
+		return pool;
+	}
+
+	template<class T>
+	static void acquireTileStorage(std::vector<T>& v, s32 size)
+	{
+		std::vector<std::vector<T>>& pool = tileStoragePool<T>();
+		if (!pool.empty())
+		{
+			v.swap(pool.back());
+			pool.pop_back();
+		}
+		v.assign(size, T());
+	}
+
+	template<class T>
+	static void releaseTileStorage(std::vector<T>& v)
+	{
+		std::vector<std::vector<T>>& pool = tileStoragePool<T>();
+		if (pool.size() < 4 && v.capacity() > 0)
+			pool.push_back(std::move(v));
+	}
 
-	FilmTile::FilmTile(const Bounds2i& pixelBounds, const FilterTable& filterTable)
+	FilmTile::FilmTile(const Bounds2i& pixelBounds, const Bounds2i& sampleBounds, const FilterTable& filterTable)
 		: mPixelBounds(pixelBounds),
+		mSampleBounds(sampleBounds),
 		mFilterTable(filterTable)
 	{
-		mPixels = std::vector<Pixel>(std::max(0, pixelBounds.area()));
+		acquireTileStorage(mPixels, std::max(0, pixelBounds.area()));
+		acquireTileStorage(mStats, std::max(0, sampleBounds.area()));
+	}
+
+	FilmTile::~FilmTile()
+	{
+		releaseTileStorage(mPixels);
+		releaseTileStorage(mStats);
 	}
 	
 	void FilmTile::addSample(const Vector2f& pFilm, Spectrum L)
 	{ 
+		Point2i ps(Math::IFloor(pFilm.x), Math::IFloor(pFilm.y));
+		if (ps.x >= mSampleBounds.pMin.x && ps.x < mSampleBounds.pMax.x &&
+			ps.y >= mSampleBounds.pMin.y && ps.y < mSampleBounds.pMax.y)
+		{
+			s32 sw = mSampleBounds.pMax.x - mSampleBounds.pMin.x;
+			mStats[(ps.x - mSampleBounds.pMin.x) + (ps.y - mSampleBounds.pMin.y) * sw].add(L.illum());
+		}
+
 		// Transform continuous space sample to discrete space	
 		Vector2f pFilmDiscrete = pFilm - Vector2f(0.5f);
 		Vector2f tmp = pFilmDiscrete - mFilterTable.getFilterRadius();
@@ -54,19 +98,25 @@ namespace tk
 					Math::ICeil(resolution.y * cropMax.y)));
 
 		mPixels = new Pixel[mCroppedPixelBounds.area()];
-		mSplat = new Spectrum[mCroppedPixelBounds.area()];
+		mStats = new PixelStats[mCroppedPixelBounds.area()];
+		mRowMutex.reset(new std::mutex[mCroppedPixelBounds.pMax.y - mCroppedPixelBounds.pMin.y]);
+		static std::atomic<u64> nextId(1);
+		mId = nextId++;
 	}
 
 	Film::~Film()
 	{
 		delete[] mPixels;
-		delete[] mSplat;
+		delete[] mStats;
 	}
 
 	void Film::clear()
 	{
 		memset(mPixels, 0, mCroppedPixelBounds.area() * sizeof(Pixel));
-		memset(mSplat, 0, mCroppedPixelBounds.area() * sizeof(Spectrum));
+		memset(mStats, 0, mCroppedPixelBounds.area() * sizeof(PixelStats));
+		std::lock_guard<std::mutex> lock(mSplatMutex);
+		for (std::unique_ptr<SplatBuffer>& buffer : mSplatBuffers)
+			memset(buffer->splats.get(), 0, mCroppedPixelBounds.area() * sizeof(Spectrum));
 	}
 
 	Bounds2i Film::getSampleBounds()const
@@ -87,7 +137,9 @@ namespace tk
 			Math::IFloor(sampleBounds.pMax.y - 0.5f + mFilter->yWidth)) + Point2i(1, 1);
 		Bounds2i tilePixelBounds = Bounds2i(p0, p1);
 		tilePixelBounds.intersect(mCroppedPixelBounds);
-		FilmTile* tile = new FilmTile(tilePixelBounds, mFilterTable);
+		Bounds2i tileSampleBounds = sampleBounds;
+		tileSampleBounds.intersect(mCroppedPixelBounds);
+		FilmTile* tile = new FilmTile(tilePixelBounds, tileSampleBounds, mFilterTable);
 		return std::unique_ptr<FilmTile>(tile);
 	}
 
@@ -99,15 +151,67 @@ namespace tk
 		s32 h = mCroppedPixelBounds.pMax.y - mCroppedPixelBounds.pMin.y;
 		if (x < 0 || y < 0 || x >= w || y >= h)
 			return;
-		mSplat[x + y * w] += L;
+		getSplatBuffer()[x + y * w] += L;
+	}
+
+	Spectrum* Film::getSplatBuffer()
+	{
+		// Most recently used buffer of this thread, films are told apart by id as a
+		// new film may reuse the address of a deleted one
+		static thread_local u64 cachedFilm = 0;
+		static thread_local Spectrum* cachedBuffer = nullptr;
+		if (cachedFilm == mId)
+			return cachedBuffer;
+
+		std::thread::id self = std::this_thread::get_id();
+		std::lock_guard<std::mutex> lock(mSplatMutex);
+		SplatBuffer* buffer = nullptr;
+		for (std::unique_ptr<SplatBuffer>& b : mSplatBuffers)
+		{
+			if (b->owner == self)
+				buffer = b.get();
+		}
+		if (!buffer)
+		{
+			mSplatBuffers.push_back(std::make_unique<SplatBuffer>());
+			buffer = mSplatBuffers.back().get();
+			buffer->owner = self;
+			buffer->splats.reset(new Spectrum[mCroppedPixelBounds.area()]);
+			memset(buffer->splats.get(), 0, mCroppedPixelBounds.area() * sizeof(Spectrum));
+		}
+		cachedFilm = mId;
+		cachedBuffer = buffer->splats.get();
+		return cachedBuffer;
+	}
+
+	std::vector<Spectrum> Film::reduceSplats()const
+	{
+		std::vector<const Spectrum*> buffers;
+		{
+			std::lock_guard<std::mutex> lock(mSplatMutex);
+			for (const std::unique_ptr<SplatBuffer>& b : mSplatBuffers)
+				buffers.push_back(b->splats.get());
+		}
+		std::vector<Spectrum> splats(mCroppedPixelBounds.area(), Spectrum::black);
+		if (buffers.empty())
+			return splats;
+		Parrallel::parrallelFor(0, (s32)splats.size(), [&](s32 start, s32 end) {
+			for (const Spectrum* buffer : buffers)
+				for (s32 i = start; i < end; ++i)
+					splats[i] += buffer[i];
+		});
+		return splats;
 	}
 
 	void Film::mergeFilmTile(std::unique_ptr<FilmTile> tile)
-	{ 
+	{
+		// Pixels further than the filter radius from the sample bounds only receive
+		// this tile's samples and are written without locking
 		s32 w = mCroppedPixelBounds.pMax.x - mCroppedPixelBounds.pMin.x;
-		for (s32 y = tile->mPixelBounds.pMin.y; y < tile->mPixelBounds.pMax.y; ++y)
-		{
-			for (s32 x = tile->mPixelBounds.pMin.x; x < tile->mPixelBounds.pMax.x; ++x)
+		Point2i margin(Math::ICeil(mFilter->xWidth + 0.5f), Math::ICeil(mFilter->yWidth + 0.5f));
+		Bounds2i interior(tile->mSampleBounds.pMin + margin, tile->mSampleBounds.pMax - margin);
+		auto mergeSpan = [&](s32 y, s32 x0, s32 x1) {
+			for (s32 x = x0; x < x1; ++x)
 			{
 				const Pixel& tilePixel = tile->getPixel(Point2i(x, y));
 				s32 offset =
@@ -115,7 +219,54 @@ namespace tk
 				mPixels[offset].contribSum += tilePixel.contribSum;
 				mPixels[offset].filterWeightSum += tilePixel.filterWeightSum;
 			}
+		};
+		for (s32 y = tile->mPixelBounds.pMin.y; y < tile->mPixelBounds.pMax.y; ++y)
+		{
+			s32 x0 = tile->mPixelBounds.pMin.x, x1 = tile->mPixelBounds.pMax.x;
+			s32 i0 = x1, i1 = x1;
+			if (y >= interior.pMin.y && y < interior.pMax.y && interior.pMin.x < interior.pMax.x)
+			{
+				i0 = std::max(x0, interior.pMin.x);
+				i1 = std::min(x1, interior.pMax.x);
+				mergeSpan(y, i0, i1);
+			}
+			if (x0 < i0 || i1 < x1)
+			{
+				std::lock_guard<std::mutex> lock(mRowMutex[y - mCroppedPixelBounds.pMin.y]);
+				mergeSpan(y, x0, i0);
+				mergeSpan(y, i1, x1);
+			}
+		}
+		// Each pixel's statistics come from the one tile whose sample bounds hold it
+		for (s32 y = tile->mSampleBounds.pMin.y; y < tile->mSampleBounds.pMax.y; ++y)
+		{
+			for (s32 x = tile->mSampleBounds.pMin.x; x < tile->mSampleBounds.pMax.x; ++x)
+			{
+				s32 offset =
+					(x - mCroppedPixelBounds.pMin.x) + (y - mCroppedPixelBounds.pMin.y) * w;
+				mStats[offset].merge(tile->getPixelStats(Point2i(x, y)));
+			}
+		}
+	}
+
+	const PixelStats& Film::getPixelStats(const Point2i& p)const
+	{
+		s32 w = mCroppedPixelBounds.pMax.x - mCroppedPixelBounds.pMin.x;
+		return mStats[(p.x - mCroppedPixelBounds.pMin.x) + (p.y - mCroppedPixelBounds.pMin.y) * w];
+	}
+
+	Real Film::getMeanRelativeError()const
+	{
+		Real sum = 0;
+		s32 count = 0;
+		for (s32 i = 0; i < mCroppedPixelBounds.area(); ++i)
+		{
+			if (mStats[i].count < 2)
+				continue;
+			sum += mStats[i].relativeError();
+			++count;
 		}
+		return count > 0 ? sum / count : Math::pos_infinity;
 	}
 
 	void Film::writeImage(Real splatScale, const string& filename)
@@ -125,6 +276,7 @@ namespace tk
 		s32 w = endX - startX;
 		s32 h = endY - startY;
 		u8* frame = new u8[w * h * 3];
+		std::vector<Spectrum> splats = reduceSplats();
 		s32 offset = 0;
 		for (s32 y = endY; y-- > 0; )
 		{
@@ -135,7 +287,7 @@ namespace tk
 				Real filterWeightSum = mPixels[idx].filterWeightSum;
 				if (filterWeightSum != 0)
 					c = c / filterWeightSum;
-				c += mSplat[idx] * splatScale;
+				c += splats[idx] * splatScale;
 				frame[offset++] = (u8)255 * Math::Pow(Math::Clamp(c.r, 0.0f, 1.0f), 0.6);
 				frame[offset++] = (u8)255 * Math::Pow(Math::Clamp(c.g, 0.0f, 1.0f), 0.6);
 				frame[offset++] = (u8)255 * Math::Pow(Math::Clamp(c.b, 0.0f, 1.0f), 0.6);
@@ -153,13 +305,14 @@ namespace tk
 	void Film::setFrame(u32* buffer, Real splatScale)
 	{
 		Point2i d = mCroppedPixelBounds.diagonal();
+		std::vector<Spectrum> splats = reduceSplats();
 		for (s32 i = 0; i < d.x * d.y; ++i)
 		{
 			Spectrum c = mPixels[i].contribSum;
 			Real filterWeightSum = mPixels[i].filterWeightSum;
 			if (filterWeightSum != 0)
 				c = c / filterWeightSum;
-			c += mSplat[i] * splatScale;
+			c += splats[i] * splatScale;
 			u32 p = 0;
 			p |= (u32)(255 * Math::Pow(Math::Clamp(c.b, 0.0f, 1.0f), 0.6)) << 16;
 			p |= (u32)(255 * Math::Pow(Math::Clamp(c.g, 0.0f, 1.0f), 0.6)) << 8;
@@ -4,6 +4,8 @@
 #include "TkPrerequisites.h"
 #include "TkFilter.h"
 #include "TkSpectrum.h"
+#include <mutex>
+#include <thread>
 
 namespace tk
 {
@@ -13,6 +15,43 @@ namespace tk
 		Real filterWeightSum;
 	};
 
+	// Running statistics of the luminance of a pixel's samples (Welford)
+	struct PixelStats
+	{
+		s32 count;
+		Real mean;
+		Real m2;
+
+		void add(Real v)
+		{
+			++count;
+			Real delta = v - mean;
+			mean += delta / count;
+			m2 += delta * (v - mean);
+		}
+
+		void merge(const PixelStats& other)
+		{
+			if (other.count == 0)
+				return;
+			s32 n = count + other.count;
+			Real delta = other.mean - mean;
+			mean += delta * other.count / n;
+			m2 += other.m2 + delta * delta * ((Real)count * other.count / n);
+			count = n;
+		}
+
+		Real variance()const { return count > 1 ? m2 / (count - 1) : 0; }
+
+		// Standard error of the mean relative to the mean
+		Real relativeError()const
+		{
+			if (count < 2)
+				return Math::pos_infinity;
+			return std::sqrt(variance() / count) / std::max(mean, (Real)1e-3);
+		}
+	};
+
 	class Film
 	{
 	private:
@@ -20,8 +59,22 @@ namespace tk
 		Filter* mFilter;
 		FilterTable mFilterTable;
 		Pixel* mPixels;
-		Spectrum* mSplat;
+		PixelStats* mStats;
 		Bounds2i mCroppedPixelBounds;
+		// Full frame splat buffer of every thread that splatted, summed on write-out
+		// so splatting never takes a lock
+		struct SplatBuffer
+		{
+			std::thread::id owner;
+			std::unique_ptr<Spectrum[]> splats;
+		};
+		std::vector<std::unique_ptr<SplatBuffer>> mSplatBuffers;
+		mutable std::mutex mSplatMutex;
+		// Guards the rows of the filter border that neighbouring tiles share
+		std::unique_ptr<std::mutex[]> mRowMutex;
+		u64 mId;
+		Spectrum* getSplatBuffer();
+		std::vector<Spectrum> reduceSplats()const;
 	public:
 		Film(const Point2i& resolution, Vector2f cropMin, Vector2f cropMax,
 			Filter* filter);
@@ -32,7 +85,11 @@ namespace tk
 
 		std::unique_ptr<FilmTile> getFilmTile(const Bounds2i& sampleBounds);
 		void addSplat(const Vector2f& pFilm, Spectrum L);
+		// Safe to call concurrently for tiles with disjoint sample bounds
 		void mergeFilmTile(std::unique_ptr<FilmTile> tile);
+		const PixelStats& getPixelStats(const Point2i& p)const;
+		// Average relative error of the pixels with at least two samples
+		Real getMeanRelativeError()const;
 		void writeImage(Real splatScale = 1, const string& filename = "");
 
 		void setFrame(u32* buffer, Real splatScale = 1);
@@ -43,12 +100,21 @@ namespace tk
 	{
 	private:
 		Bounds2i mPixelBounds;
+		Bounds2i mSampleBounds;
 		const FilterTable& mFilterTable;
 		std::vector<Pixel> mPixels;
+		// Statistics of the samples taken in each pixel of mSampleBounds
+		std::vector<PixelStats> mStats;
 		friend class Film;
 	public:
-		FilmTile(const Bounds2i& pixelBounds, const FilterTable& filterTable);
+		FilmTile(const Bounds2i& pixelBounds, const Bounds2i& sampleBounds, const FilterTable& filterTable);
+		~FilmTile();
 		void addSample(const Vector2f& pFilm, Spectrum L);
+		const PixelStats& getPixelStats(const Point2i &p)const
+		{
+			int width = mSampleBounds.pMax.x - mSampleBounds.pMin.x;
+			return mStats[(p.x - mSampleBounds.pMin.x) + (p.y - mSampleBounds.pMin.y) * width];
+		}
 		const Pixel& getPixel(const Point2i &p)const
 		{
 			int width = mPixelBounds.pMax.x - mPixelBounds.pMin.x;
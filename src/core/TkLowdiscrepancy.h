@@ -11,17 +11,37 @@ namespace tk
 	// Prime Table Declarations
 	static constexpr s32 PrimeTableSize = 1000;
 	extern const s32 Primes[PrimeTableSize];
+	// Offset of each base's digit permutation in ComputeRadicalInversePermutations
+	extern const s32 PrimeSums[PrimeTableSize];
+
+	// Sobol (0,2)-sequence generator matrices, column i of dimension 0 packed
+	// in the high word and column i of dimension 1 in the low word
+	static constexpr s32 SobolMatrixSize = 32;
+	extern const u64 SobolMatrices02[SobolMatrixSize];
 
 	// Low Discrepancy Declarations
 	Real RadicalInverse(s32 baseIndex, u64 a);
+	Real ScrambledRadicalInverse(s32 baseIndex, u64 a, const u16* perm);
+	std::vector<u16> ComputeRadicalInversePermutations(u64 seed);
 
 	// Low Discrepancy Inline Functions
-	inline Real RadicalInverse(s32 baseIndex, u64 a) {
-		s32 base = Primes[baseIndex];
-		Real invBase = (Real)1 / (Real)base, invBaseN = 1;
+	inline u64 ReverseBits64(u64 n) {
+		n = (n << 32) | (n >> 32);
+		n = ((n & 0x0000ffff0000ffffull) << 16) | ((n & 0xffff0000ffff0000ull) >> 16);
+		n = ((n & 0x00ff00ff00ff00ffull) << 8) | ((n & 0xff00ff00ff00ff00ull) >> 8);
+		n = ((n & 0x0f0f0f0f0f0f0f0full) << 4) | ((n & 0xf0f0f0f0f0f0f0f0ull) >> 4);
+		n = ((n & 0x3333333333333333ull) << 2) | ((n & 0xccccccccccccccccull) >> 2);
+		n = ((n & 0x5555555555555555ull) << 1) | ((n & 0xaaaaaaaaaaaaaaaaull) >> 1);
+		return n;
+	}
+
+	// Base known at compile time, so the divisions become multiplications
+	template <u64 base>
+	inline Real RadicalInverseSpecialized(u64 a) {
+		const Real invBase = (Real)1 / (Real)base;
 		u64 reversedDigits = 0;
+		Real invBaseN = 1;
 		while (a) {
-			// Extract least significant digit from _a_ and update _reversedDigits_
 			u64 next = a / base;
 			u64 digit = a - next * base;
 			reversedDigits = reversedDigits * base + digit;
@@ -31,6 +51,23 @@ namespace tk
 		return tk::min(reversedDigits * invBaseN, Math::one_minus_epsilon);
 	}
 
+	template <u64 base>
+	inline Real ScrambledRadicalInverseSpecialized(const u16* perm, u64 a) {
+		const Real invBase = (Real)1 / (Real)base;
+		u64 reversedDigits = 0;
+		Real invBaseN = 1;
+		while (a) {
+			u64 next = a / base;
+			u64 digit = a - next * base;
+			reversedDigits = reversedDigits * base + perm[digit];
+			invBaseN *= invBase;
+			a = next;
+		}
+		// The remaining (infinite) zero digits map to perm[0]
+		return tk::min(invBaseN * (reversedDigits + invBase * perm[0] / (1 - invBase)),
+			Math::one_minus_epsilon);
+	}
+
 	inline u64 InverseRadicalInverse(u64 inverse, s32 base,
 		s32 nDigits) {
 		u64 index = 0;
@@ -41,5 +78,39 @@ namespace tk
 		}
 		return index;
 	}
+
+	inline u32 ReverseBits32(u32 n) {
+		n = (n << 16) | (n >> 16);
+		n = ((n & 0x00ff00ff) << 8) | ((n & 0xff00ff00) >> 8);
+		n = ((n & 0x0f0f0f0f) << 4) | ((n & 0xf0f0f0f0) >> 4);
+		n = ((n & 0x33333333) << 2) | ((n & 0xcccccccc) >> 2);
+		n = ((n & 0x55555555) << 1) | ((n & 0xaaaaaaaa) >> 1);
+		return n;
+	}
+
+	// Both dimensions of the (0,2)-sequence in one pass, each set bit of _a_
+	// xors the packed column pair into the accumulator
+	inline u64 Sobol02(u32 a, u64 scramble = 0) {
+		u64 v = scramble;
+		for (s32 i = 0; a; a >>= 1, ++i)
+			if (a & 1)
+				v ^= SobolMatrices02[i];
+		return v;
+	}
+
+	// Hash based nested uniform (Owen) scrambling, Burley 2020
+	inline u32 OwenScramble(u32 v, u32 seed) {
+		v = ReverseBits32(v);
+		v += seed;
+		v ^= v * 0x6c50b47c;
+		v ^= v * 0xb82f1e52;
+		v ^= v * 0xc7afe638;
+		v ^= v * 0x8d22f6e6;
+		return ReverseBits32(v);
+	}
+
+	inline Real SobolToReal(u32 v) {
+		return tk::min(v * 0x1p-32f, Math::one_minus_epsilon);
+	}
 }
 #endif
\ No newline at end of file
@@ -4,17 +4,31 @@
 
 #include <GL/glew.h>
 #include <thread>
+#include <chrono>
 
 namespace tk
 {
-	RayTracer::RayTracer(s32 spp, s32 maxDepth, s32 numThreads, Real russianRoulette)
+	RayTracer::RayTracer(s32 spp, s32 maxDepth, Real russianRoulette)
 		: mState(INIT),
-		mNumThreads(numThreads),
-		mMaxDepth(maxDepth),
-		mRussianRoulette(russianRoulette),
 		mScene(nullptr),
 		mCamera(nullptr),
 		mFrameBuffer(nullptr),
+		mNextTile(0),
+		mTileOrder(TILE_ROWMAJOR),
+		mTileSize(20),
+		mPilotSpp(0),
+		mJobsDone(0),
+		mJobsCount(0),
+		mMaxDepth(maxDepth),
+		mRussianRoulette(russianRoulette),
+		mAdaptiveThreshold(0),
+		mAdaptiveMinSpp(0),
+		mSamplesTaken(0),
+		mPassSpp(0),
+		mTimeBudget(0),
+		mNoiseTarget(0),
+		mPassStart(0),
+		mPassEnd(0),
 		mSampler(nullptr)
 	{
 		spp--;
@@ -51,6 +65,313 @@ namespace tk
 		mState = READY;
 	}
 
+	void RayTracer::setSampler(Sampler* sampler)
+	{
+		// The tracer owns the sampler, a rejected one is freed here
+		if (mState != INIT && mState != READY)
+		{
+			delete sampler;
+			return;
+		}
+		delete mSampler;
+		mSampler = sampler;
+		requestSamples(mSampler);
+	}
+
+	void RayTracer::setAdaptive(Real threshold, s32 minSpp)
+	{
+		if (mState != INIT && mState != READY)
+			return;
+		mAdaptiveThreshold = threshold;
+		mAdaptiveMinSpp = std::max(minSpp, 2);
+	}
+
+	void RayTracer::setProgressive(s32 passSpp, Real timeBudget, Real noiseTarget)
+	{
+		if (mState != INIT && mState != READY)
+			return;
+		mPassSpp = passSpp;
+		mTimeBudget = timeBudget;
+		mNoiseTarget = noiseTarget;
+	}
+
+	void RayTracer::setTiles(s32 tileSize, eTileOrder order, s32 pilotSpp)
+	{
+		if (mState != INIT && mState != READY)
+			return;
+		mTileSize = std::max(tileSize, 1);
+		mTileOrder = order;
+		mPilotSpp = std::max(pilotSpp, 0);
+	}
+
+	// Maps _d_ to a cell of an n x n Hilbert curve, n a power of two
+	static Point2i hilbertToXY(s32 n, s32 d)
+	{
+		s32 x = 0, y = 0;
+		for (s32 s = 1; s < n; s <<= 1)
+		{
+			s32 rx = 1 & (d >> 1);
+			s32 ry = 1 & (d ^ rx);
+			if (ry == 0)
+			{
+				if (rx == 1)
+				{
+					x = s - 1 - x;
+					y = s - 1 - y;
+				}
+				std::swap(x, y);
+			}
+			x += s * rx;
+			y += s * ry;
+			d >>= 2;
+		}
+		return Point2i(x, y);
+	}
+
+	void RayTracer::buildTiles()
+	{
+		s32 nx = (mEndPos.x + mTileSize - 1) / mTileSize;
+		s32 ny = (mEndPos.y + mTileSize - 1) / mTileSize;
+		std::vector<Point2i> order;
+		order.reserve(nx * ny);
+		switch (mTileOrder)
+		{
+		case TILE_HILBERT:
+		{
+			s32 n = 1;
+			while (n < std::max(nx, ny))
+				n <<= 1;
+			for (s32 d = 0; d < n * n; ++d)
+			{
+				Point2i t = hilbertToXY(n, d);
+				if (t.x < nx && t.y < ny)
+					order.push_back(t);
+			}
+		}
+			break;
+		case TILE_SPIRAL:
+		{
+			// Rings around the centre tile, each walked by angle
+			for (s32 y = 0; y < ny; ++y)
+				for (s32 x = 0; x < nx; ++x)
+					order.push_back(Point2i(x, y));
+			Real cx = (nx - 1) * 0.5f, cy = (ny - 1) * 0.5f;
+			auto ring = [&](const Point2i& t) {
+				return std::max(std::abs(t.x - cx), std::abs(t.y - cy)); };
+			auto angle = [&](const Point2i& t) {
+				return std::atan2(t.y - cy, t.x - cx); };
+			std::stable_sort(order.begin(), order.end(), [&](const Point2i& a, const Point2i& b) {
+				Real ra = std::floor(ring(a)), rb = std::floor(ring(b));
+				return ra != rb ? ra < rb : angle(a) < angle(b);
+			});
+		}
+			break;
+		default:
+			for (s32 y = 0; y < ny; ++y)
+				for (s32 x = 0; x < nx; ++x)
+					order.push_back(Point2i(x, y));
+			break;
+		}
+
+		mTiles.clear();
+		mTiles.reserve(order.size());
+		for (const Point2i& t : order)
+		{
+			Point2i start(t.x * mTileSize, t.y * mTileSize);
+			Point2i end(std::min(start.x + mTileSize, mEndPos.x), std::min(start.y + mTileSize, mEndPos.y));
+			mTiles.push_back(Bounds2i(start, end));
+		}
+		mJobsCount = (s32)mTiles.size();
+		resetTiles();
+	}
+
+	void RayTracer::resetTiles()
+	{
+		mNextTile = 0;
+		mJobsDone = 0;
+	}
+
+	bool RayTracer::nextTile(Point2i* start, Point2i* end)
+	{
+		s32 idx = mNextTile.fetch_add(1, std::memory_order_relaxed);
+		if (idx >= mJobsCount)
+			return false;
+		*start = mTiles[idx].pMin;
+		*end = mTiles[idx].pMax;
+		return true;
+	}
+
+	bool RayTracer::traceNextTile(Sampler& sampler)
+	{
+		s32 idx = mNextTile.fetch_add(1, std::memory_order_relaxed);
+		if (idx >= mJobsCount)
+			return false;
+		const Bounds2i& b = mTiles[idx];
+		if (mTileCosts.empty())
+			traceTile(b.pMin, b.pMax, sampler);
+		else
+		{
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			traceTile(b.pMin, b.pMax, sampler);
+			mTileCosts[idx] = std::chrono::duration<Real>(std::chrono::steady_clock::now() - start).count();
+		}
+		++mJobsDone;
+		return true;
+	}
+
+	void RayTracer::scheduleTilesByCost()
+	{
+		struct Job
+		{
+			Bounds2i bounds;
+			Real cost;
+			bool operator<(const Job& rhs)const { return cost < rhs.cost; }
+		};
+		std::vector<Job> heap(mTiles.size()), jobs;
+		Real totalCost = 0;
+		for (size_t i = 0; i < mTiles.size(); ++i)
+		{
+			heap[i].bounds = mTiles[i];
+			heap[i].cost = mTileCosts[i];
+			totalCost += mTileCosts[i];
+		}
+
+		// Split tiles into quadrants until none holds more than a small share of the
+		// work, assuming the cost is spread evenly over each tile
+		const s32 minTileSize = 4;
+		Real maxCost = totalCost / (8 * Parrallel::parrallelThreads());
+		std::make_heap(heap.begin(), heap.end());
+		while (!heap.empty() && heap.front().cost > maxCost)
+		{
+			std::pop_heap(heap.begin(), heap.end());
+			Job job = heap.back();
+			heap.pop_back();
+			Point2i diag = job.bounds.diagonal();
+			if (diag.x < 2 * minTileSize && diag.y < 2 * minTileSize)
+			{
+				// Too small to split further, keep it out of the heap
+				jobs.push_back(job);
+				continue;
+			}
+			Point2i mid = job.bounds.pMin + Point2i(diag.x >= 2 * minTileSize ? diag.x / 2 : diag.x,
+				diag.y >= 2 * minTileSize ? diag.y / 2 : diag.y);
+			Point2i pMin = job.bounds.pMin, pMax = job.bounds.pMax;
+			Bounds2i parts[4] = {
+				Bounds2i(pMin, mid),
+				Bounds2i(Point2i(mid.x, pMin.y), Point2i(pMax.x, mid.y)),
+				Bounds2i(Point2i(pMin.x, mid.y), Point2i(mid.x, pMax.y)),
+				Bounds2i(mid, pMax) };
+			Real area = Real(diag.x) * diag.y;
+			for (s32 i = 0; i < 4; ++i)
+			{
+				Point2i d = parts[i].diagonal();
+				if (d.x <= 0 || d.y <= 0)
+					continue;
+				heap.push_back({ parts[i], job.cost * d.x * d.y / area });
+				std::push_heap(heap.begin(), heap.end());
+			}
+		}
+		jobs.insert(jobs.end(), heap.begin(), heap.end());
+		std::sort(jobs.begin(), jobs.end(), [](const Job& a, const Job& b) { return a.cost > b.cost; });
+
+		mTiles.resize(jobs.size());
+		for (size_t i = 0; i < jobs.size(); ++i)
+			mTiles[i] = jobs[i].bounds;
+		mJobsCount = (s32)mTiles.size();
+		resetTiles();
+	}
+
+	void RayTracer::traceTileSamples(Point2i start, Point2i end, Sampler& sampler, const FilmTile* tile,
+		const std::function<void(const Point2i&)>& sample)
+	{
+		s32 spp = sampler.getSamplesPerPixel();
+		s64 taken = 0;
+		if (mPassEnd > 0)
+		{
+			// One progressive pass, pixels already converged in earlier passes are skipped
+			for (s32 y = start.y; y < end.y; ++y)
+			{
+				for (s32 x = start.x; x < end.x; ++x)
+				{
+					Point2i pixel = Point2i(x, y);
+					if (mAdaptiveThreshold > 0)
+					{
+						const PixelStats& stats = mFilm->getPixelStats(pixel);
+						if (stats.count >= mAdaptiveMinSpp && stats.relativeError() < mAdaptiveThreshold)
+							continue;
+					}
+					for (s32 i = mPassStart; i < mPassEnd; ++i)
+					{
+						sampler.startPixelSample(pixel, i);
+						sample(pixel);
+					}
+					taken += mPassEnd - mPassStart;
+				}
+			}
+			mSamplesTaken += taken;
+			return;
+		}
+		if (mAdaptiveThreshold <= 0 || !tile)
+		{
+			for (s32 y = start.y; y < end.y; ++y)
+			{
+				for (s32 x = start.x; x < end.x; ++x)
+				{
+					Point2i pixel = Point2i(x, y);
+					sampler.startPixel(pixel);
+					do {
+						sample(pixel);
+					} while (sampler.startNextSample());
+					taken += spp;
+				}
+			}
+			mSamplesTaken += taken;
+			return;
+		}
+		if (end.x <= start.x || end.y <= start.y)
+			return;
+
+		// Rounds double in size, converged pixels drop out after each one
+		s32 w = end.x - start.x;
+		std::vector<u8> converged(w * (end.y - start.y), 0);
+		s32 active = (s32)converged.size();
+		for (s32 first = 0, last = std::min(mAdaptiveMinSpp, spp); first < spp && active > 0;
+			first = last, last = std::min(2 * last, spp))
+		{
+			for (s32 y = start.y; y < end.y; ++y)
+			{
+				for (s32 x = start.x; x < end.x; ++x)
+				{
+					s32 idx = (x - start.x) + (y - start.y) * w;
+					if (converged[idx])
+						continue;
+					Point2i pixel = Point2i(x, y);
+					for (s32 i = first; i < last; ++i)
+					{
+						sampler.startPixelSample(pixel, i);
+						sample(pixel);
+					}
+					taken += last - first;
+					if (tile->getPixelStats(pixel).relativeError() < mAdaptiveThreshold)
+					{
+						converged[idx] = 1;
+						--active;
+					}
+				}
+			}
+		}
+		mSamplesTaken += taken;
+	}
+
+	Real RayTracer::getSplatScale()const
+	{
+		s64 taken = mSamplesTaken;
+		if (taken == 0)
+			return 1;
+		// Splats are divided by mSpp, rescale to the average samples per pixel
+		return (Real)mSpp * mEndPos.x * mEndPos.y / taken;
+	}
+
 	void RayTracer::updateScreen()
 	{
 		switch (mState)
@@ -110,15 +431,19 @@ namespace tk
 	{
 		if (mState != READY)
 			return;
+		prepareRendering();
+		mContinueRendering = true;
+		startWorkerThreads();
+	}
+
+	void RayTracer::prepareRendering()
+	{
 		mState = RENDERING;
-		mNextStart = Point2i(0, 0);
-		mTileSize = 20;
-		mJobsDone = 0;
-		mJobsCount = (mEndPos.x * mEndPos.y + mTileSize * mTileSize - 1) / (mTileSize * mTileSize);
+		mSamplesTaken = 0;
+		fprintf(stderr, "\r[Tracer] Number of threads: %d, spp: %d\n", Parrallel::parrallelThreads(), mSpp);
+		buildTiles();
 		mFilm->clear();
 		memset(mFrameBuffer, 0, sizeof(u32) * mEndPos.x * mEndPos.y);
-		mContinueRendering = true;
-		startWorkerThreads();
 	}
 
 	void RayTracer::saveImage(string filename)
@@ -136,85 +461,122 @@ namespace tk
 				<< lt->tm_hour << "-" << lt->tm_min << "-" << lt->tm_sec << ".ppm";
 			filename = ss.str();	
 		}
-		mFilm->writeImage(1.0, filename);
+		mFilm->writeImage(getSplatScale(), filename);
+	}
+
+	void RayTracer::traceTiles()
+	{
+		while (traceNextTile(*mSampler))
+			fprintf(stderr, "\r[Tracer] Rendering...... %02d%%", std::min(int((Real)(mJobsDone) / mJobsCount * 100), 100));
+	}
+
+	void RayTracer::tracePass(s32 passStart, s32 passEnd)
+	{
+		mPassStart = passStart;
+		mPassEnd = passEnd;
+		resetTiles();
+		mContinueRendering = true;
+		startWorkerThreads();
+		traceTiles();
+		stopRaytracing();
 	}
 
 	void RayTracer::render(string filename)
 	{
-		startRaytracing();
-		while (mNextStart.y < mEndPos.y)
+		if (mPassSpp > 0)
 		{
-			mutex.lock();
-			Point2i start = mNextStart;
-			Point2i end = mNextStart + Point2i(mTileSize, mTileSize);
-			mNextStart.x += mTileSize;
-			if (mNextStart.x >= mEndPos.x)
-			{
-				mNextStart.x = 0;
-				end.x = mEndPos.x;
-				mNextStart.y += mTileSize;
-			}
-			mutex.unlock();
-			end.y = std::min(end.y, mEndPos.y);
-			traceTile(start, end, *mSampler);
-			fprintf(stderr, "\r[Tracer] Rendering...... %02d%%", std::min(int((Real)(++mJobsDone) / mJobsCount * 100), 100));
+			renderProgressive(filename);
+			return;
 		}
-		stopRaytracing();
+		if (mPilotSpp > 0 && mPilotSpp < mSpp)
+		{
+			if (mState != READY)
+				return;
+			prepareRendering();
+			// The pilot samples are kept, the main pass takes the remaining ones
+			mTileCosts.assign(mTiles.size(), 0);
+			tracePass(0, mPilotSpp);
+			size_t numTiles = mTiles.size();
+			scheduleTilesByCost();
+			mTileCosts.clear();
+			fprintf(stderr, "\n[Tracer] Pilot pass: %d spp, %d tiles split into %d\n",
+				mPilotSpp, (s32)numTiles, mJobsCount);
+			tracePass(mPilotSpp, mSpp);
+			mPassStart = mPassEnd = 0;
+		}
+		else
+		{
+			startRaytracing();
+			traceTiles();
+			stopRaytracing();
+		}
+		if (mAdaptiveThreshold > 0)
+			fprintf(stderr, "\n[Tracer] Adaptive sampling: %.2f spp on average\n",
+				(Real)mSamplesTaken / (mEndPos.x * mEndPos.y));
 		mState = DONE;
 		saveImage(filename);
 	}
 
-	unsigned long RayTracer::updateWorkerThread(ThreadHandle* handle)
+	void RayTracer::renderProgressive(string filename)
 	{
-		std::unique_ptr<Sampler> tileSampler = mSampler->clone(handle->getThreadIdx());
-		while (mContinueRendering)
+		typedef std::chrono::steady_clock Clock;
+		if (mState != READY)
+			return;
+		prepareRendering();
+
+		Clock::time_point begin = Clock::now();
+		Real lastPass = 0;
+		for (s32 passStart = 0; passStart < mSpp; )
 		{
-			mutex.lock();
-			Point2i start = mNextStart;
-			Point2i end = mNextStart + Point2i(mTileSize, mTileSize);
-			mNextStart.x += mTileSize;
-			if (mNextStart.x >= mEndPos.x)
-			{
-				mNextStart.x = 0;
-				end.x = mEndPos.x;
-				mNextStart.y += mTileSize;
-			}
-			mutex.unlock();
-			end.y = std::min<s32>(end.y, mEndPos.y);
-			traceTile(start, end, *tileSampler);
-			++mJobsDone;
+			s32 passEnd = std::min(passStart + mPassSpp, mSpp);
+			Clock::time_point passBegin = Clock::now();
+			tracePass(passStart, passEnd);
+			Clock::time_point now = Clock::now();
+			lastPass = std::chrono::duration<Real>(now - passBegin).count();
+			Real elapsed = std::chrono::duration<Real>(now - begin).count();
+
+			// The image on disk is always the latest complete pass
+			mFilm->writeImage(getSplatScale(), filename);
+			Real noise = mFilm->getMeanRelativeError();
+			if (std::isfinite(noise))
+				fprintf(stderr, "[Tracer] Pass %d-%d spp, %.1fs, mean relative error %.4f\n",
+					passStart, passEnd, elapsed, noise);
+			else
+				fprintf(stderr, "[Tracer] Pass %d-%d spp, %.1fs\n", passStart, passEnd, elapsed);
+			passStart = passEnd;
+			if (mNoiseTarget > 0 && noise <= mNoiseTarget)
+				break;
+			// Stop if another pass would not fit in the time budget
+			if (mTimeBudget > 0 && elapsed + lastPass > mTimeBudget)
+				break;
 		}
-		return 0;
+		mPassStart = mPassEnd = 0;
+		mState = DONE;
 	}
 
-	unsigned long updateWorkerThread(ThreadHandle* handle)
+	void RayTracer::updateWorkerThread(s32 threadIdx)
 	{
-		RayTracer* tracer = reinterpret_cast<RayTracer*>(handle->getUserParameter());
-		return tracer->updateWorkerThread(handle);
+		std::unique_ptr<Sampler> tileSampler = mSampler->clone(threadIdx);
+		while (mContinueRendering)
+		{
+			if (!traceNextTile(*tileSampler))
+				break;
+		}
 	}
 
-	THREAD_DECL(updateWorkerThread);
-
 	void RayTracer::startWorkerThreads()
 	{
-		int numThreads = mNumThreads > 0 ? mNumThreads : std::thread::hardware_concurrency();
-		fprintf(stderr, "\r[Tracer] Number of threads: %d, spp: %d\n", numThreads, mSpp);
-		workerThreads.reserve(numThreads);
-		for (size_t i = 0; i < numThreads; ++i)
-		{
-			ThreadHandle* handle = Threads::createThread(THREAD_GET(updateWorkerThread), i + 1, this);
-			workerThreads.push_back(handle);
-		}
+		// The calling thread renders too, the pool workers take the remaining threads
+		s32 numThreads = Parrallel::parrallelThreads();
+		mWorkers = Parrallel::parrallelAsync(numThreads - 1, [this](s32 i) {
+			updateWorkerThread(i + 1);
+		});
 	}
 
 	void RayTracer::stopRaytracing()
 	{
 		mContinueRendering = false;
-		Threads::waitForThreads(workerThreads);
-		std::vector<ThreadHandle*>::iterator it = workerThreads.begin();
-		std::vector<ThreadHandle*>::iterator end = workerThreads.end();
-		while (it != end)
-			delete *it++;
-		workerThreads.clear();
+		Parrallel::parrallelWait(mWorkers);
+		mWorkers.reset();
 	}
 }
\ No newline at end of file
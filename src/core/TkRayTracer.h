@@ -8,6 +8,13 @@
 
 namespace tk
 {
+	enum eTileOrder
+	{
+		TILE_ROWMAJOR,
+		TILE_HILBERT,
+		TILE_SPIRAL
+	};
+
 	class RayTracer
 	{
 	protected:
@@ -25,29 +32,68 @@ namespace tk
 		Film* mFilm;
 		u32* mFrameBuffer;
 
-		std::vector<ThreadHandle*> workerThreads;
-		LwMutex mutex, mutex1;
+		// Tile workers running on the shared Parrallel pool
+		std::shared_ptr<ParallelJob> mWorkers;
 		bool mContinueRendering;
-		Point2i mNextStart;
 		Point2i mEndPos;
+		// Tiles of the current pass in dispatch order, claimed through mNextTile
+		std::vector<Bounds2i> mTiles;
+		std::atomic<s32> mNextTile;
+		eTileOrder mTileOrder;
 		s32 mTileSize;
-		s32 mNumThreads;
-		s32 mJobsDone;
+		// Samples per pixel of the pilot pass that times each tile, 0 disables it
+		s32 mPilotSpp;
+		std::vector<Real> mTileCosts;
+		std::atomic<s32> mJobsDone;
 		s32 mJobsCount;
 		s32 mSpp;
 		s32 mMaxDepth;
 		Real mRussianRoulette;
+		// Pixels stop sampling once their relative error drops below the threshold
+		Real mAdaptiveThreshold;
+		s32 mAdaptiveMinSpp;
+		std::atomic<s64> mSamplesTaken;
+		// Progressive rendering: passes of mPassSpp samples until a budget is reached
+		s32 mPassSpp;
+		Real mTimeBudget;
+		Real mNoiseTarget;
+		s32 mPassStart, mPassEnd;
 		Sampler* mSampler;
 		virtual void visualize() = 0;
 		virtual void rendering() = 0;
 		void startWorkerThreads();
 		void stopRaytracing();
 		virtual void traceTile(Point2i start, Point2i end, Sampler& sampler) = 0;
+		// Requests the sample arrays the tracer uses, called for every sampler it is given
+		virtual void requestSamples(Sampler* sampler) {}
+		// Runs _sample_ for every camera sample of the tile (or of the current progressive
+		// pass), in adaptive rounds if enabled and _tile_ is given
+		void traceTileSamples(Point2i start, Point2i end, Sampler& sampler, const FilmTile* tile,
+			const std::function<void(const Point2i&)>& sample);
+		void buildTiles();
+		void resetTiles();
+		// Claims the next tile, false once every tile of the pass has been handed out
+		bool nextTile(Point2i* start, Point2i* end);
+		// Traces the next tile (timing it during a pilot pass), false once none are left
+		bool traceNextTile(Sampler& sampler);
+		// Splits and reorders the tiles largest-first from the pilot pass timings
+		void scheduleTilesByCost();
+		void traceTiles();
+		void tracePass(s32 passStart, s32 passEnd);
+		void prepareRendering();
+		void renderProgressive(string filename);
+		// Splat normalization for the camera samples actually taken
+		Real getSplatScale()const;
 	public:
-		RayTracer(s32 spp, s32 maxDepth, s32 numThreads, Real russianRoulette);
+		RayTracer(s32 spp, s32 maxDepth, Real russianRoulette);
 		virtual ~RayTracer();
 		void setScene(Scene* scene);
 		void setCamera(Camera* camera);
+		void setSampler(Sampler* sampler);
+		void setAdaptive(Real threshold, s32 minSpp);
+		void setProgressive(s32 passSpp, Real timeBudget, Real noiseTarget);
+		void setTiles(s32 tileSize, eTileOrder order, s32 pilotSpp = 0);
+		const Sampler* getSampler()const { return mSampler; }
 		void updateScreen();
 		void stop();
 		void clear();
@@ -55,7 +101,7 @@ namespace tk
 		virtual void startRaytracing();
 		virtual void keyPress(s32 key) {}
 		void saveImage(string filename = "");
-		virtual unsigned long updateWorkerThread(ThreadHandle* handle);
+		virtual void updateWorkerThread(s32 threadIdx);
 		virtual void render(string filename);
 	};
 }
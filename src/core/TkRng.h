@@ -0,0 +1,52 @@
+#ifndef __Tk_Rng_H_
+#define __Tk_Rng_H_
+
+#include "TkPrerequisites.h"
+#include "TkMath.h"
+
+namespace tk
+{
+	// PCG32 random number generator, http://www.pcg-random.org
+	class RNG
+	{
+	private:
+		static constexpr u64 DefaultState = 0x853c49e6748fea9bULL;
+		static constexpr u64 DefaultStream = 0xda3e39cb94b95bdbULL;
+		static constexpr u64 Mult = 0x5851f42d4c957f2dULL;
+		u64 state, inc;
+	public:
+		RNG() : state(DefaultState), inc(DefaultStream) {}
+		RNG(u64 seqIndex, u64 seed = DefaultState) { setSequence(seqIndex, seed); }
+
+		void setSequence(u64 seqIndex, u64 seed = DefaultState) {
+			state = 0u;
+			inc = (seqIndex << 1u) | 1u;
+			uniformU32();
+			state += seed;
+			uniformU32();
+		}
+
+		u32 uniformU32() {
+			u64 oldstate = state;
+			state = oldstate * Mult + inc;
+			u32 xorshifted = (u32)(((oldstate >> 18u) ^ oldstate) >> 27u);
+			u32 rot = (u32)(oldstate >> 59u);
+			return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+		}
+
+		// Uniform integer in [0, b) without modulo bias
+		u32 uniformU32(u32 b) {
+			u32 threshold = (~b + 1u) % b;
+			while (true) {
+				u32 r = uniformU32();
+				if (r >= threshold)
+					return r % b;
+			}
+		}
+
+		Real uniformFloat() {
+			return tk::min(Math::one_minus_epsilon, Real(uniformU32() * 0x1p-32f));
+		}
+	};
+}
+#endif
\ No newline at end of file
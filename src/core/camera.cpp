@@ -4,6 +4,7 @@
 #include "TkSpectrum.h"
 #include "TkFilm.h"
 #include "sampling.h"
+#include "TkHash.h"
 
 namespace tk
 {
@@ -127,4 +128,12 @@ namespace tk
 		*pdfPos = mLensRadius != 0 ? 1.0f / (Math::pi * mLensRadius * mLensRadius) : 1.0f;
 		*pdfDir = 1.0f / (mFilmArea * cosTheta * cosTheta * cosTheta);
 	}
+
+	u64 Camera::hash()const
+	{
+		Point2i res = mFilm->getFullResolution();
+		u64 h = HashBuffer(&(*cameraToWorld)[0][0], 16 * sizeof(float));
+		h = HashBuffer(&cameraToScreen[0][0], 16 * sizeof(float), h);
+		return Hash(h, mLensRadius, mFocalDistance, res.x, res.y);
+	}
 }
\ No newline at end of file
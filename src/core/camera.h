@@ -32,6 +32,9 @@ namespace tk
 			Intersection* it, Real* pdf, Vector2f* pRaster)const;
 
 		void Pdf_We(const Ray& r, Vector3f* n, Real* pdfPos, Real* pdfDir)const;
+
+		// Hash of the pose, projection, lens and film resolution
+		u64 hash()const;
 	};
 }
 #endif
\ No newline at end of file
@@ -5,7 +5,10 @@
 namespace tk
 {
 	Sampler::Sampler(int samplesPerPixel)
-		: samplesPerPixel(samplesPerPixel)
+		: samplesPerPixel(samplesPerPixel),
+		array1DOffset(0),
+		array2DOffset(0),
+		arraysFilled(false)
 	{}
 
 	s32 Sampler::getSamplesPerPixel()const
@@ -17,66 +20,178 @@ namespace tk
 	{
 		currentPixel = p;
 		sampleIdx = 0;
+		array1DOffset = array2DOffset = 0;
+		arraysFilled = false;
 	}
 
 	void Sampler::startPixelSample(const Point2i& p, s32 idx, s32 dim)
 	{
 		currentPixel = p;
 		sampleIdx = idx;
+		array1DOffset = array2DOffset = 0;
 	}
 
 	bool Sampler::startNextSample()
 	{
+		array1DOffset = array2DOffset = 0;
 		return ++sampleIdx < samplesPerPixel;
 	}
 
+	void Sampler::request1DArray(s32 n)
+	{
+		n = roundCount(n);
+		samples1DArraySizes.push_back(n);
+		sampleArray1D.push_back(std::vector<Real>(n * samplesPerPixel));
+	}
+
+	void Sampler::request2DArray(s32 n)
+	{
+		n = roundCount(n);
+		samples2DArraySizes.push_back(n);
+		sampleArray2D.push_back(std::vector<Vector2f>(n * samplesPerPixel));
+	}
+
+	void Sampler::copyArrayRequests(Sampler* other)const
+	{
+		for (s32 n : samples1DArraySizes)
+			other->request1DArray(n);
+		for (s32 n : samples2DArraySizes)
+			other->request2DArray(n);
+	}
+
+	const Real* Sampler::get1DArray(s32 n)
+	{
+		if (array1DOffset == sampleArray1D.size() || n != samples1DArraySizes[array1DOffset])
+			return nullptr;
+		Real* data = &sampleArray1D[array1DOffset][(sampleIdx % samplesPerPixel) * n];
+		// Samplers without precomputed arrays fill them from their own dimensions
+		if (!arraysFilled || sampleIdx >= samplesPerPixel)
+			for (s32 i = 0; i < n; ++i)
+				data[i] = get1D();
+		++array1DOffset;
+		return data;
+	}
+
+	const Vector2f* Sampler::get2DArray(s32 n)
+	{
+		if (array2DOffset == sampleArray2D.size() || n != samples2DArraySizes[array2DOffset])
+			return nullptr;
+		Vector2f* data = &sampleArray2D[array2DOffset][(sampleIdx % samplesPerPixel) * n];
+		if (!arraysFilled || sampleIdx >= samplesPerPixel)
+			for (s32 i = 0; i < n; ++i)
+				data[i] = get2D();
+		++array2DOffset;
+		return data;
+	}
+
+	//-------------------------------------------------------------------------------------------
+	void StratifiedSampler::generatePixelSamples(const Point2i &p)
+	{
+		RNG pixelRng(Hash(p, seed));
+		for (size_t i = 0; i < samples1D.size(); ++i)
+		{
+			stratifiedSample1D(&samples1D[i][0], samplesPerPixel, pixelRng, jitter);
+			shuffle(&samples1D[i][0], samplesPerPixel, 1, pixelRng);
+		}
+		for (size_t i = 0; i < samples2D.size(); ++i)
+		{
+			stratifiedSample2D(&samples2D[i][0], xPixelSamples, yPixelSamples, pixelRng, jitter);
+			shuffle(&samples2D[i][0], samplesPerPixel, 1, pixelRng);
+		}
+		for (size_t i = 0; i < samples1DArraySizes.size(); ++i)
+			for (s32 j = 0; j < samplesPerPixel; ++j)
+			{
+				s32 count = samples1DArraySizes[i];
+				stratifiedSample1D(&sampleArray1D[i][j * count], count, pixelRng, jitter);
+				shuffle(&sampleArray1D[i][j * count], count, 1, pixelRng);
+			}
+		for (size_t i = 0; i < samples2DArraySizes.size(); ++i)
+			for (s32 j = 0; j < samplesPerPixel; ++j)
+			{
+				s32 count = samples2DArraySizes[i];
+				latinHypercube(&sampleArray2D[i][j * count].x, count, 2, pixelRng);
+			}
+		generatedPixel = p;
+		arraysFilled = true;
+	}
+
+	void StratifiedSampler::startSample()
+	{
+		// Jitter for the hashed dimensions, one stream per sample so random access is stable
+		if (jitter)
+			rng.setSequence(Hash(currentPixel, seed), sampleIdx);
+	}
 
 	void StratifiedSampler::startPixel(const Point2i &p)
 	{
 		dim = 0;
+		current1DDim = current2DDim = 0;
 		Sampler::startPixel(p);
+		if (precomputedDims > 0 || !sampleArray1D.empty() || !sampleArray2D.empty())
+			generatePixelSamples(p);
+		startSample();
 	}
 
-	void  StratifiedSampler::startPixelSample(const Point2i& p, s32 idx, s32 dim)
+	void StratifiedSampler::startPixelSample(const Point2i& p, s32 idx, s32 dim)
 	{
 		this->dim = dim;
+		// The precomputed dimensions are only served to samples starting at dimension 0
+		current1DDim = current2DDim = dim == 0 ? 0 : precomputedDims;
 		Sampler::startPixelSample(p, idx, dim);
+		if ((precomputedDims > 0 || !sampleArray1D.empty() || !sampleArray2D.empty()) &&
+			(!arraysFilled || generatedPixel.x != p.x || generatedPixel.y != p.y))
+			generatePixelSamples(p);
+		startSample();
 	}
 
 	float StratifiedSampler::get1D()
 	{
+		if (current1DDim < precomputedDims && sampleIdx < samplesPerPixel)
+		{
+			++dim;
+			return samples1D[current1DDim++][sampleIdx];
+		}
 		u64 hash = Hash(currentPixel, dim, seed);
 		s32 stratum = Math::PermutationElement(sampleIdx, samplesPerPixel, hash);
 		++dim;
-		Real delta = jitter ? get_random_float() : 0.5f;
+		Real delta = jitter ? rng.uniformFloat() : 0.5f;
 		return (stratum + delta) / samplesPerPixel;
 	}
 
 	Vector2f StratifiedSampler::get2D()
 	{
+		if (current2DDim < precomputedDims && sampleIdx < samplesPerPixel)
+		{
+			dim += 2;
+			return samples2D[current2DDim++][sampleIdx];
+		}
 		u64 hash = Hash(currentPixel, dim, seed);
 		s32 stratum = Math::PermutationElement(sampleIdx, samplesPerPixel, hash);
 		dim += 2;
 		s32 x = stratum % xPixelSamples, y = stratum / xPixelSamples;
-		Real dx = jitter ? get_random_float() : 0.5f;
-		Real dy = jitter ? get_random_float() : 0.5f;
+		Real dx = jitter ? rng.uniformFloat() : 0.5f;
+		Real dy = jitter ? rng.uniformFloat() : 0.5f;
 		return { (x + dx) / xPixelSamples, (y + dy) / yPixelSamples };
 	}
 
 	bool StratifiedSampler::startNextSample()
 	{
 		dim = 0;
-		return Sampler::startNextSample();
+		current1DDim = current2DDim = 0;
+		bool ret = Sampler::startNextSample();
+		startSample();
+		return ret;
 	}
 
 	std::unique_ptr<Sampler> StratifiedSampler::clone(int seed)
 	{
-		StratifiedSampler* ret = new StratifiedSampler(xPixelSamples, yPixelSamples, jitter, seed);
+		StratifiedSampler* ret = new StratifiedSampler(xPixelSamples, yPixelSamples, jitter, seed, precomputedDims);
+		copyArrayRequests(ret);
 		return std::unique_ptr<Sampler>(ret);
 	}
 
 	//-------------------------------------------------------------------------------------------
-	HaltonSampler::HaltonSampler(s32 samplesPerPixel, Point2i fullRes, s32 seed)
+	HaltonSampler::HaltonSampler(s32 samplesPerPixel, Point2i fullRes, s32 seed, bool scramble)
 		: Sampler(samplesPerPixel)
 	{
 		// Find radical inverse base scales and exponents that cover sampling area
@@ -93,23 +208,24 @@ namespace tk
 		// Compute multiplicative inverses for _baseScales_
 		multInverse[0] = multiplicativeInverse(baseScales[1], baseScales[0]);
 		multInverse[1] = multiplicativeInverse(baseScales[0], baseScales[1]);
+		// Built once per render and shared with every worker's clone
+		if (scramble)
+			permutations = std::make_shared<const std::vector<u16>>(ComputeRadicalInversePermutations(seed));
 	}
 
 	HaltonSampler::HaltonSampler(s32 samplesPerPixel, Point2i baseScales, Point2i baseExponents,
-		s32 multInv[2]) : Sampler(samplesPerPixel),
-		baseScales(baseScales), baseExponents(baseExponents)
+		s32 multInv[2], std::shared_ptr<const std::vector<u16>> permutations)
+		: Sampler(samplesPerPixel),
+		baseScales(baseScales), baseExponents(baseExponents),
+		permutations(permutations)
 	{
 		multInverse[0] = multInv[0];
 		multInverse[1] = multInv[1];
 	}
-	Real HaltonSampler::sampleDimension(s32 dim)const
-	{
-		return RadicalInverse(dim, haltonIdx);
-	}
 
-	void HaltonSampler::startPixel(const Point2i &p)
+	s64 HaltonSampler::pixelIndex(const Point2i& p)const
 	{
-		haltonIdx = 0;
+		s64 index = 0;
 		s32 sampleStride = baseScales.x * baseScales.y;
 		// Compute Halton sample index for first sample in pixel _p_
 		if (sampleStride > 1) {
@@ -118,33 +234,34 @@ namespace tk
 				u64 dimOffset =
 					(i == 0) ? InverseRadicalInverse(pm[i], 2, baseExponents[i])
 					: InverseRadicalInverse(pm[i], 3, baseExponents[i]);
-				haltonIdx +=
+				index +=
 					dimOffset * (sampleStride / baseScales[i]) * multInverse[i];
 			}
-			haltonIdx %= sampleStride;
+			index %= sampleStride;
 		}
-		//haltonIdx += sampleIdx * sampleStride;
+		return index;
+	}
+
+	Real HaltonSampler::sampleDimension(s32 dim)const
+	{
+		// The first two dimensions select the pixel and must stay unscrambled
+		if (permutations && dim > 1)
+			return ScrambledRadicalInverse(dim, haltonIdx, permutations->data() + PrimeSums[dim]);
+		return RadicalInverse(dim, haltonIdx);
+	}
+
+	void HaltonSampler::startPixel(const Point2i &p)
+	{
+		pixelOffset = pixelIndex(p);
+		haltonIdx = pixelOffset;
 		dim = 2;
 		Sampler::startPixel(p);
 	}
 
 	void HaltonSampler::startPixelSample(const Point2i& p, s32 idx, s32 dim)
 	{
-		haltonIdx = 0;
-		s32 sampleStride = baseScales.x * baseScales.y;
-		// Compute Halton sample index for first sample in pixel _p_
-		if (sampleStride > 1) {
-			Point2i pm(Math::Mod(p.x, MaxHaltonResolution), Math::Mod(p.y, MaxHaltonResolution));
-			for (s32 i = 0; i < 2; ++i) {
-				u64 dimOffset =
-					(i == 0) ? InverseRadicalInverse(pm[i], 2, baseExponents[i])
-					: InverseRadicalInverse(pm[i], 3, baseExponents[i]);
-				haltonIdx +=
-					dimOffset * (sampleStride / baseScales[i]) * multInverse[i];
-			}
-			haltonIdx %= sampleStride;
-		}
-		haltonIdx += sampleIdx * sampleStride;
+		pixelOffset = pixelIndex(p);
+		haltonIdx = pixelOffset + (s64)idx * baseScales.x * baseScales.y;
 		this->dim = std::max(2, dim);
 		Sampler::startPixelSample(p, idx, dim);
 	}
@@ -162,34 +279,92 @@ namespace tk
 			dim = 2;
 		s32 d = dim;
 		dim += 2;
-		return { sampleDimension(dim), sampleDimension(dim + 1) };
+		return { sampleDimension(d), sampleDimension(d + 1) };
 	}
 
 	bool HaltonSampler::startNextSample()
 	{
-		haltonIdx = 0;
-		int sampleStride = baseScales.x * baseScales.y;
-		// Compute Halton sample index for first sample in pixel _p_
-		if (sampleStride > 1) {
-			Point2i pm(Math::Mod(currentPixel.x, MaxHaltonResolution), Math::Mod(currentPixel.y, MaxHaltonResolution));
-			for (int i = 0; i < 2; ++i) {
-				u64 dimOffset =
-					(i == 0) ? InverseRadicalInverse(pm[i], 2, baseExponents[i])
-					: InverseRadicalInverse(pm[i], 3, baseExponents[i]);
-				haltonIdx +=
-					dimOffset * (sampleStride / baseScales[i]) * multInverse[i];
-			}
-			haltonIdx %= sampleStride;
-		}
-
-		haltonIdx += (sampleIdx + 1) * sampleStride;
+		haltonIdx = pixelOffset + (s64)(sampleIdx + 1) * baseScales.x * baseScales.y;
 		dim = 2;
 		return Sampler::startNextSample();
 	}
 
 	std::unique_ptr<Sampler> HaltonSampler::clone(int seed)
 	{
-		HaltonSampler* ret = new HaltonSampler(samplesPerPixel, baseScales, baseExponents, multInverse);
+		HaltonSampler* ret = new HaltonSampler(samplesPerPixel, baseScales, baseExponents, multInverse, permutations);
+		copyArrayRequests(ret);
+		return std::unique_ptr<Sampler>(ret);
+	}
+
+	//-------------------------------------------------------------------------------------------
+	SobolSampler::SobolSampler(s32 samplesPerPixel, eScramble scramble, s32 seed)
+		: Sampler(samplesPerPixel),
+		scramble(scramble),
+		seed(seed)
+	{
+	}
+
+	u32 SobolSampler::permutedIndex(u32 hash)const
+	{
+		// Nested uniform scrambling of the index shuffles the sequence while every aligned
+		// power of two prefix still maps to a block of the sequence, i.e. a (0,m,2)-net.
+		// Sample rounds (adaptive or progressive) therefore stay stratified.
+		return OwenScramble(sampleIdx, hash);
+	}
+
+	u32 SobolSampler::scrambleBits(u32 v, u32 hash)const
+	{
+		switch (scramble)
+		{
+		case XOR:
+			return v ^ hash;
+		case OWEN:
+			return OwenScramble(v, hash);
+		default:
+			return v;
+		}
+	}
+
+	void SobolSampler::startPixel(const Point2i &p)
+	{
+		dim = 0;
+		Sampler::startPixel(p);
+	}
+
+	void SobolSampler::startPixelSample(const Point2i& p, s32 idx, s32 dim)
+	{
+		this->dim = dim;
+		Sampler::startPixelSample(p, idx, dim);
+	}
+
+	float SobolSampler::get1D()
+	{
+		u64 hash = Hash(currentPixel, dim, seed);
+		++dim;
+		u32 v = ReverseBits32(permutedIndex(u32(hash)));
+		return SobolToReal(scrambleBits(v, u32(hash >> 32)));
+	}
+
+	Vector2f SobolSampler::get2D()
+	{
+		u64 hash = Hash(currentPixel, dim, seed);
+		dim += 2;
+		u64 v = Sobol02(permutedIndex(u32(hash)));
+		u64 hash1 = MixBits(hash);
+		return { SobolToReal(scrambleBits(u32(v >> 32), u32(hash >> 32))),
+			SobolToReal(scrambleBits(u32(v), u32(hash1))) };
+	}
+
+	bool SobolSampler::startNextSample()
+	{
+		dim = 0;
+		return Sampler::startNextSample();
+	}
+
+	std::unique_ptr<Sampler> SobolSampler::clone(int seed)
+	{
+		SobolSampler* ret = new SobolSampler(samplesPerPixel, scramble, this->seed);
+		copyArrayRequests(ret);
 		return std::unique_ptr<Sampler>(ret);
 	}
 }
\ No newline at end of file
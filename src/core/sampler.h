@@ -3,6 +3,7 @@
 
 #include "TkPrerequisites.h"
 #include "Vector.hpp"
+#include "TkRng.h"
 
 namespace tk
 {
@@ -13,6 +14,15 @@ namespace tk
 		Point2i currentPixel;
 		int sampleIdx;
 		int samplesPerPixel;
+		// Requested sample arrays, samplesPerPixel * n values each
+		std::vector<s32> samples1DArraySizes, samples2DArraySizes;
+		std::vector<std::vector<Real>> sampleArray1D;
+		std::vector<std::vector<Vector2f>> sampleArray2D;
+		size_t array1DOffset, array2DOffset;
+		// Set by samplers that fill the arrays up front in startPixel
+		bool arraysFilled;
+
+		void copyArrayRequests(Sampler* other)const;
 	public:
 		Sampler(int samplesPerPixel);
 
@@ -23,7 +33,15 @@ namespace tk
 		virtual Vector2f get2D() = 0;
 		virtual bool startNextSample();
 		virtual std::unique_ptr<Sampler> clone(int numDimensions) = 0;
-		
+
+		// Must be called before rendering (and before clone)
+		void request1DArray(s32 n);
+		void request2DArray(s32 n);
+		virtual s32 roundCount(s32 n)const { return n; }
+		// Arrays are returned in request order, n must be the requested count after
+		// roundCount. nullptr once they are used up or when n does not match.
+		const Real* get1DArray(s32 n);
+		const Vector2f* get2DArray(s32 n);
 	};
 
 	class StratifiedSampler : public Sampler
@@ -32,14 +50,29 @@ namespace tk
 		int xPixelSamples, yPixelSamples, seed;
 		bool jitter;
 		int dim;
+		// Leading dimensions generated and shuffled once per pixel
+		s32 precomputedDims;
+		std::vector<std::vector<Real>> samples1D;
+		std::vector<std::vector<Vector2f>> samples2D;
+		s32 current1DDim, current2DDim;
+		Point2i generatedPixel;
+		RNG rng;
+
+		void generatePixelSamples(const Point2i &p);
+		void startSample();
 	public:
 		StratifiedSampler(int xPixelSamples, int yPixelSamples,
-			bool jitter, int seed = 0)
+			bool jitter, int seed = 0, s32 precomputedDims = 0)
 			: Sampler(xPixelSamples * yPixelSamples),
 			xPixelSamples(xPixelSamples),
 			yPixelSamples(yPixelSamples),
+			seed(seed),
 			jitter(jitter),
-			seed(seed)
+			precomputedDims(precomputedDims),
+			samples1D(precomputedDims, std::vector<Real>(xPixelSamples * yPixelSamples)),
+			samples2D(precomputedDims, std::vector<Vector2f>(xPixelSamples * yPixelSamples)),
+			current1DDim(0),
+			current2DDim(0)
 		{
 		}
 
@@ -60,11 +93,13 @@ namespace tk
 		Point2i baseScales, baseExponents;
 		s32 multInverse[2];
 		s64 haltonIdx;
+		s64 pixelOffset;
 		s32 dim;
-
+		// Digit permutations shared by all clones, empty when unscrambled
+		std::shared_ptr<const std::vector<u16>> permutations;
 
 		HaltonSampler(s32 samplesPerPixel, Point2i baseScales, Point2i baseExponents,
-			s32 multInv[2]);
+			s32 multInv[2], std::shared_ptr<const std::vector<u16>> permutations);
 		static u64 multiplicativeInverse(s64 a, s64 n) {
 			s64 x, y;
 			extendedGCD(a, n, &x, &y);
@@ -82,9 +117,40 @@ namespace tk
 			*x = yp;
 			*y = xp - (d * yp);
 		}
+		s64 pixelIndex(const Point2i& p)const;
 		Real sampleDimension(s32 dim)const;
 	public:
-		HaltonSampler(s32 samplesPerPixel, Point2i fullResolution, s32 seed = 0);
+		HaltonSampler(s32 samplesPerPixel, Point2i fullResolution, s32 seed = 0, bool scramble = true);
+		void startPixel(const Point2i &p);
+		void startPixelSample(const Point2i& p, s32 idx, s32 dim);
+
+		float get1D();
+		Vector2f get2D();
+
+		bool startNextSample();
+		std::unique_ptr<Sampler> clone(int seed);
+	};
+
+	// Padded (0,2)-sequence sampler, every dimension pair is drawn from the first
+	// two Sobol dimensions with a per pixel and dimension index shuffle
+	class SobolSampler : public Sampler
+	{
+	public:
+		enum eScramble
+		{
+			NONE,
+			XOR,
+			OWEN
+		};
+	private:
+		eScramble scramble;
+		s32 seed;
+		s32 dim;
+
+		u32 permutedIndex(u32 hash)const;
+		u32 scrambleBits(u32 v, u32 hash)const;
+	public:
+		SobolSampler(s32 samplesPerPixel, eScramble scramble = OWEN, s32 seed = 0);
 		void startPixel(const Point2i &p);
 		void startPixelSample(const Point2i& p, s32 idx, s32 dim);
 
@@ -2,30 +2,49 @@
 
 namespace tk
 {
-	void stratifiedSample1D(float *data, int numSamples, bool jitter)
+	void stratifiedSample1D(float *data, int numSamples, RNG &rng, bool jitter)
 	{
 		float dx = 1.0f / numSamples;
 		for (int i = 0; i < numSamples; ++i)
 		{
-			float delta = jitter ? get_random_float() : 0.5f;
+			float delta = jitter ? rng.uniformFloat() : 0.5f;
 			data[i] = min((i + delta) * dx, Math::one_minus_epsilon);
 		}
 	}
 
-	void stratifiedSample2D(Vector2f *data, int xSamples, int ySamples, bool jitter)
+	void stratifiedSample2D(Vector2f *data, int xSamples, int ySamples, RNG &rng, bool jitter)
 	{
 		float dx = 1.0f / xSamples, dy = 1.0f / ySamples;
 		for (int y = 0; y < ySamples; ++y)
 			for (int x = 0; x < xSamples; ++x)
 			{
-				float jx = jitter ? get_random_float() : 0.5f;
-				float jy = jitter ? get_random_float() : 0.5f;
+				float jx = jitter ? rng.uniformFloat() : 0.5f;
+				float jy = jitter ? rng.uniformFloat() : 0.5f;
 				data->x = min((x + jx) * dx, Math::one_minus_epsilon);
 				data->y = min((y + jy) * dy, Math::one_minus_epsilon);
 				++data;
 			}
 	}
 
+	void latinHypercube(float *data, int numSamples, int nDim, RNG &rng)
+	{
+		// Generate LHS samples along diagonal
+		float invNSamples = 1.0f / numSamples;
+		for (int i = 0; i < numSamples; ++i)
+			for (int j = 0; j < nDim; ++j)
+			{
+				float sj = (i + rng.uniformFloat()) * invNSamples;
+				data[nDim * i + j] = min(sj, Math::one_minus_epsilon);
+			}
+		// Permute LHS samples in each dimension
+		for (int i = 0; i < nDim; ++i)
+			for (int j = 0; j < numSamples; ++j)
+			{
+				int other = j + rng.uniformU32(numSamples - j);
+				std::swap(data[nDim * j + i], data[nDim * other + i]);
+			}
+	}
+
 	Vector3f uniformSampleHemisphere(const Vector2f& u)
 	{
 		float z = u.x;
@@ -2,18 +2,20 @@
 #define SAMPLING_H
 
 #include "Vector.hpp"
+#include "TkRng.h"
 
 namespace tk
 {
-	void stratifiedSample1D(float *data, int numSamples, bool jitter);
-	void stratifiedSample2D(Vector2f *data, int xSamples, int ySamples, bool jitter);
+	void stratifiedSample1D(float *data, int numSamples, RNG &rng, bool jitter);
+	void stratifiedSample2D(Vector2f *data, int xSamples, int ySamples, RNG &rng, bool jitter);
+	void latinHypercube(float *data, int numSamples, int nDim, RNG &rng);
 
 	template <typename T>
-	void shuffle(T *data, int count, int nDim)
+	void shuffle(T *data, int count, int nDim, RNG &rng)
 	{
 		for (int i = 0; i < count; ++i)
 		{
-			int other = i + get_random_float() * (count - i);
+			int other = i + rng.uniformU32(count - i);
 			for (int j = 0; j < nDim; ++j)
 				std::swap(data[nDim * i + j], data[nDim * other + j]);
 		}
@@ -55,7 +57,7 @@ namespace tk
 		std::vector<float> cdf, func;
 		Distribution1D() = default;
 		Distribution1D(const float* f, int num)
-			: func(f, f + num), cdf(num + 1)
+			: cdf(num + 1), func(f, f + num)
 		{
 			cdf[0] = 0;
 			for (int i = 1; i < num + 1; ++i)
@@ -7,6 +7,19 @@
 #include "Object.hpp"
 #include "sampler.h"
 #include "quickselect.h"
+#include <mutex>
+#include <cstddef>
+#include <cstring>
+#if (defined( __WIN32__ ) || defined( _WIN32 ))
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace tk
 {
@@ -18,63 +31,66 @@ namespace tk
 #define PHOTON_NORMAL_OFFSET (Real(.1))
 
 	PhotonMap::PhotonMap(s32 size, s32 sampleCount)
-		: root(0), mStoredPhotons(size), sampleCount(sampleCount),
-		geometry_array(0)
+		: mStoredPhotons(size), mNumPhotons(0), sampleCount(sampleCount),
+		geometry_array(0), mIrradianceRadius2(0)
 	{
-		root = (KdTree*)malloc(sizeof(KdTree) * size);
-		all_raw_photons.reserve(size);
-		for (int i = 0; i < 256; ++i)
+		all_raw_photons.resize(size);
+		for (int i = 0; i < 3; ++i)
 		{
-			double radians = double(i) * Math::pi / 255.0;
-			cosTheta[i] = cos(radians);
-			sinTheta[i] = sin(radians);
-			cosPhi[i] = cos(2.0 * radians);
-			sinPhi[i] = sin(2.0 * radians);
-		}	
+			mNodePos[i].resize(size);
+			mTree.pos[i] = mNodePos[i].data();
+		}
+		mNodePower.resize(size);
+		mNodeDir.resize(size);
+		mNodeNormal.resize(size);
+		mTree.power = mNodePower.data();
+		mTree.dir = mNodeDir.data();
+		mTree.normal = mNodeNormal.data();
+		mTree.numNodes = 0;
 	}
 
 	PhotonMap::~PhotonMap() {
 		all_raw_photons.clear();
-		if (root)
-			free(root);
 		if (geometry_array)
 			glDeleteBuffers(1, &geometry_array);
 	}
 
-	bool PhotonMap::storePhoton(Vector3f pos, Spectrum power, u8 theta, u8 phi, s32& num)
+	void PhotonMap::reset()
 	{
-		if (all_raw_photons.size() >= mStoredPhotons)
-			return false;
-		
-		all_raw_photons.emplace_back(pos, power, theta, phi);
-		Union(bbox, pos);
-		num++;
-		return true;
+		mNumPhotons = 0;
+		if (mIrradianceMap)
+			mIrradianceMap->reset();
+	}
+
+	void PhotonMap::storePhotons(s32 offset, const Photon* photons, s32 count)
+	{
+		count = std::min(count, mStoredPhotons - offset);
+		if (count > 0)
+			std::copy(photons, photons + count, all_raw_photons.begin() + offset);
 	}
 
 	void PhotonMap::update_photons()
 	{
 		if (!geometry_array)
 			glGenBuffers(1, &geometry_array);
-		float *temp = new float[mStoredPhotons * 6];
-		for (size_t i = 0; i < mStoredPhotons; i++)
-		{
-			Photon& p = all_raw_photons[i];
-			Vector3f pos = p.pos;
-			float tmp = sinTheta[p.theta];
-			Vector3f out = -Vector3f(tmp * cosPhi[p.phi], tmp * sinPhi[p.phi], cosTheta[p.theta]);
-			pos += out * PHOTON_NORMAL_OFFSET;
+		// Read from the kd-tree, which may be attached from a cache file
+		s32 numPhotons = mTree.numNodes;
+		float *temp = new float[numPhotons * 6];
+		for (s32 i = 0; i < numPhotons; i++)
+		{
+			Vector3f pos(mTree.pos[0][i], mTree.pos[1][i], mTree.pos[2][i]);
+			pos = pos - DecodeDirection(mTree.dir[i]) * PHOTON_NORMAL_OFFSET;
 			temp[6 * i] = pos.x;
 			temp[6 * i + 1] = pos.y;
 			temp[6 * i + 2] = pos.z;
-			Spectrum color = all_raw_photons[i].power;
+			Spectrum color = DecodeRGBE(mTree.power[i]);
 			temp[6 * i + 3] = color.r;
 			temp[6 * i + 4] = color.g;
 			temp[6 * i + 5] = color.b;
 		}
 		glBindBuffer(GL_ARRAY_BUFFER, geometry_array);
 		glGetError();
-		glBufferData(GL_ARRAY_BUFFER, mStoredPhotons * 6 * sizeof(GLfloat), temp, GL_STATIC_DRAW);
+		glBufferData(GL_ARRAY_BUFFER, numPhotons * 6 * sizeof(GLfloat), temp, GL_STATIC_DRAW);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 		delete[] temp;
 	}
@@ -87,94 +103,413 @@ namespace tk
 		glVertexPointer(3, GL_FLOAT, 6 * sizeof(float), (float*)(sizeof(float) * 0));
 		glColorPointer(3, GL_FLOAT, 6 * sizeof(float), (float*)(sizeof(float) * 3));
 		glPointSize(PHOTON_GL_POINT_SIZE);
-		glDrawArrays(GL_POINTS, 0, (GLsizei)mStoredPhotons);
+		glDrawArrays(GL_POINTS, 0, (GLsizei)stored());
 		glDisableClientState(GL_VERTEX_ARRAY);
 		glEnableClientState(GL_COLOR_ARRAY);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
 
 	void PhotonMap::buildKdTree() {
-		std::vector<Photon*> tmp(mStoredPhotons);
-		for (size_t i = 0; i < mStoredPhotons; ++i)
-			tmp[i] = &all_raw_photons[i];
-		memset(root, 0, sizeof(KdTree) * mStoredPhotons);
-		int idx = 0;
-		balance(tmp.begin(), tmp.end(), idx);
+		s32 numPhotons = stored();
+		for (int i = 0; i < 3; ++i)
+			mTree.pos[i] = mNodePos[i].data();
+		mTree.power = mNodePower.data();
+		mTree.dir = mNodeDir.data();
+		mTree.normal = mNodeNormal.data();
+		mTree.numNodes = numPhotons;
+		if (numPhotons == 0)
+			return;
+		// Bounds of the stored photons, reduced over chunks in parallel
+		std::mutex boundsMutex;
+		bbox = Bounds3();
+		Parrallel::parrallelFor(0, numPhotons, [&](s32 start, s32 end) {
+			Bounds3 b;
+			for (s32 i = start; i < end; ++i)
+				b = Union(b, all_raw_photons[i].pos);
+			std::lock_guard<std::mutex> lock(boundsMutex);
+			bbox = Union(bbox, b);
+		});
+
+		std::vector<s32> order(numPhotons);
+		for (s32 i = 0; i < numPhotons; ++i)
+			order[i] = i;
+
+		// The top levels are split breadth first with the nodes of a level in parallel,
+		// then the subtrees below them are balanced as independent tasks
+		struct Segment
+		{
+			s32 start, end, node;
+			Bounds3 bounds;
+		};
+		std::vector<Segment> level(1, Segment{ 0, numPhotons, 0, bbox });
+		const s32 numTasks = 4 * Parrallel::parrallelThreads();
+		const s32 minTaskSize = 1024;
+		while ((s32)level.size() < numTasks && level[0].end - level[0].start > minTaskSize)
+		{
+			std::vector<Segment> next(2 * level.size(), Segment{ 0, 0, 0, Bounds3() });
+			Parrallel::parrallelFor(0, (s32)level.size(), [&](s32 start, s32 end) {
+				for (s32 i = start; i < end; ++i)
+				{
+					const Segment& seg = level[i];
+					int dim = seg.bounds.maxExtent();
+					s32 median = s32(splitNode(order.begin() + seg.start, order.begin() + seg.end, seg.node, dim) - order.begin());
+					float split = mNodePos[dim][seg.node];
+					next[2 * i] = Segment{ seg.start, median, 2 * seg.node + 1, seg.bounds };
+					next[2 * i].bounds.pMax[dim] = split;
+					next[2 * i + 1] = Segment{ median + 1, seg.end, 2 * seg.node + 2, seg.bounds };
+					next[2 * i + 1].bounds.pMin[dim] = split;
+				}
+			});
+			level.clear();
+			for (const Segment& seg : next)
+				if (seg.end > seg.start)
+					level.push_back(seg);
+			if (level.empty())
+				return;
+		}
+		Parrallel::parrallelFor(0, (s32)level.size(), [&](s32 start, s32 end) {
+			for (s32 i = start; i < end; ++i)
+				balance(order.begin() + level[i].start, order.begin() + level[i].end, level[i].node, level[i].bounds);
+		});
 	}
 
 	Spectrum PhotonMap::radiance_estimate(const Intersection& isect, float& maxRadius2, int& found)const
 	{
-		NearestPhotons np;
-		np.dstPos = isect.p;
-		np.found = 0;
-		np.neighbor_photons.resize(sampleCount, 0);
-		np.dist2 = (float*)malloc(sizeof(float) * (sampleCount + 1));
-		np.dist2[sampleCount] = maxRadius2;
+		const Material* m = isect.obj->getMaterial();
+		m->setTransportMode(Radiance);
+		if (mIrradianceMap && mIrradianceMap->stored() > 0 && m->getType() == DIFFUSE)
+		{
+			// Nearest precomputed irradiance facing the same way, a few candidates are
+			// enough to skip the ones on the other side of thin geometry
+			static thread_local NearestPhotons nearest;
+			const KdTree& tree = mIrradianceMap->mTree;
+			nearest.init(isect.p, 4, mIrradianceRadius2);
+			neighbor_search(&nearest, tree);
+			s32 best = -1;
+			for (int i = 0; i < nearest.found; ++i)
+			{
+				s32 node = nearest.nodes[i];
+				if (dotProduct(DecodeDirection(tree.dir[node]), isect.n) > 0.9f &&
+					(best < 0 || nearest.dist2[i] < nearest.dist2[best]))
+					best = i;
+			}
+			if (best >= 0)
+			{
+				// Scaled to the photon sum over _maxRadius2_ the caller normalizes by
+				found = sampleCount;
+				Spectrum E = DecodeRGBE(tree.power[nearest.nodes[best]]);
+				return E * m->f(isect.wo, isect.n, isect.n) * (Math::pi * maxRadius2);
+			}
+		}
 
-		neighbor_search(&np, root, sampleCount);
-		maxRadius2 = np.dist2[sampleCount];
+		// Query scratch is kept per thread, no allocation once it has grown to sampleCount
+		static thread_local NearestPhotons np;
+		np.init(isect.p, sampleCount, maxRadius2);
+		neighbor_search(&np, mTree);
+		maxRadius2 = np.maxDist2;
 		found = np.found;
 
 		Spectrum ret;
 		for (int i = 0; i < np.found; ++i)
 		{
-			Photon *p = np.neighbor_photons[i];
-			float tmp = sinTheta[p->theta];
-			Vector3f wi = Vector3f(tmp * cosPhi[p->phi], tmp * sinPhi[p->phi], cosTheta[p->theta]);
-			const Material* m = isect.obj->getMaterial();
-			m->setTransportMode(Radiance);
-			ret += p->power * AbsDot(wi, isect.n) * m->f(isect.wo, wi, isect.n);
+			s32 node = np.nodes[i];
+			Vector3f wi = DecodeDirection(mTree.dir[node]);
+			ret += DecodeRGBE(mTree.power[node]) * AbsDot(wi, isect.n) * m->f(isect.wo, wi, isect.n);
 		}
-		free(np.dist2);
 		return ret;
 	}
 
-	KdTree* PhotonMap::balance(std::vector<Photon*>::iterator start,
-		std::vector<Photon*>::iterator end, int& idx)
+	s32 PhotonMap::precomputeIrradiance(s32 stride, float maxRadius2)
 	{
-		KdTree* node = &root[idx];
-		int dim = bbox.maxExtent();
-		std::vector<Photon*>::iterator median = quick_median<std::vector<Photon*>::iterator, Photon*>(start, end,
-			[dim](Photon* lhs, Photon* rhs)->bool {
-			return lhs->pos[dim] < rhs->pos[dim];
+		s32 count = (mTree.numNodes + stride - 1) / stride;
+		if (!mIrradianceMap || mIrradianceMap->size() < count)
+			mIrradianceMap.reset(new PhotonMap(count, 1));
+		mIrradianceMap->reset();
+		mIrradianceRadius2 = maxRadius2;
+		if (count == 0)
+			return 0;
+		// Every _stride_th node of the breadth-first tree spreads the points over the map
+		Parrallel::parrallelFor(0, count, [&](s32 start, s32 end) {
+			static thread_local NearestPhotons np;
+			std::vector<Photon> points(end - start);
+			for (s32 i = start; i < end; ++i)
+			{
+				s32 node = i * stride;
+				Vector3f pos(mTree.pos[0][node], mTree.pos[1][node], mTree.pos[2][node]);
+				Vector3f n = DecodeDirection(mTree.normal[node]);
+				np.init(pos, sampleCount, maxRadius2);
+				neighbor_search(&np, mTree);
+				Spectrum E;
+				for (int k = 0; k < np.found; ++k)
+				{
+					s32 other = np.nodes[k];
+					E += DecodeRGBE(mTree.power[other]) * AbsDot(DecodeDirection(mTree.dir[other]), n);
+				}
+				if (np.found > 0)
+					E = E / (Math::pi * np.maxDist2);
+				points[i - start] = Photon(pos, E, n, n);
+			}
+			mIrradianceMap->storePhotons(start, points.data(), end - start);
 		});
-		(*median)->split = dim;
-		node->pt = *median;
+		mIrradianceMap->setStored(count);
+		mIrradianceMap->buildKdTree();
+		return count;
+	}
+
+	std::vector<s32>::iterator PhotonMap::splitNode(std::vector<s32>::iterator start,
+		std::vector<s32>::iterator end, s32 node, int dim)
+	{
+		// Size of the left subtree of a left-balanced tree with n nodes
+		s32 n = s32(end - start);
+		s32 leftSize = 0;
+		if (n > 1)
+		{
+			s32 h = 0;
+			while ((2 << h) <= n)
+				++h;
+			s32 half = 1 << (h - 1);
+			leftSize = half - 1 + std::min(n - ((1 << h) - 1), half);
+			std::minstd_rand generator;
+			quick_select<std::vector<s32>::iterator, s32>(generator, 0, start, end, start + leftSize,
+				[this, dim](s32 lhs, s32 rhs)->bool {
+				return all_raw_photons[lhs].pos[dim] < all_raw_photons[rhs].pos[dim];
+			});
+		}
+		std::vector<s32>::iterator median = start + leftSize;
+
+		const Photon& p = all_raw_photons[*median];
+		for (int i = 0; i < 3; ++i)
+			mNodePos[i][node] = p.pos[i];
+		mNodePower[node] = p.power;
+		mNodeDir[node] = u16(p.dir | (dim << 14));
+		mNodeNormal[node] = p.normal;
+		return median;
+	}
 
+	void PhotonMap::balance(std::vector<s32>::iterator start, std::vector<s32>::iterator end,
+		s32 node, Bounds3 bounds)
+	{
+		int dim = bounds.maxExtent();
+		std::vector<s32>::iterator median = splitNode(start, end, node, dim);
+		float split = mNodePos[dim][node];
 		if (median > start)
 		{
-			++idx;
-			if (start < median - 1)
-			{
-				const float tmp = bbox.pMax[dim];
-				bbox.pMax[dim] = (*median)->pos[dim];
-				node->left = balance(start, median, idx);
-				bbox.pMax[dim] = tmp;
-			}
-			else
-			{
-				KdTree* child = &root[idx];
-				child->pt = *start;
-				node->left = child;
-			}
+			Bounds3 left = bounds;
+			left.pMax[dim] = split;
+			balance(start, median, 2 * node + 1, left);
+		}
+		if (median + 1 < end)
+		{
+			Bounds3 right = bounds;
+			right.pMin[dim] = split;
+			balance(median + 1, end, 2 * node + 2, right);
+		}
+	}
+
+	size_t PhotonMap::serializedSize(s32 numPhotons)
+	{
+		// The two u16 arrays keep every array 4-byte aligned
+		return (3 * sizeof(float) + sizeof(u32) + 2 * sizeof(u16)) * numPhotons;
+	}
+
+	bool PhotonMap::save(FILE* fp)const
+	{
+		s32 n = mTree.numNodes;
+		bool ok = true;
+		for (int i = 0; i < 3; ++i)
+			ok &= fwrite(mTree.pos[i], sizeof(float), n, fp) == (size_t)n;
+		ok &= fwrite(mTree.power, sizeof(u32), n, fp) == (size_t)n;
+		ok &= fwrite(mTree.dir, sizeof(u16), n, fp) == (size_t)n;
+		ok &= fwrite(mTree.normal, sizeof(u16), n, fp) == (size_t)n;
+		return ok;
+	}
+
+	void PhotonMap::attach(const u8* data, s32 numPhotons)
+	{
+		for (int i = 0; i < 3; ++i)
+			mTree.pos[i] = reinterpret_cast<const float*>(data + sizeof(float) * numPhotons * i);
+		mTree.power = reinterpret_cast<const u32*>(data + sizeof(float) * numPhotons * 3);
+		mTree.dir = reinterpret_cast<const u16*>(data + (sizeof(float) * 3 + sizeof(u32)) * numPhotons);
+		mTree.normal = mTree.dir + numPhotons;
+		mTree.numNodes = numPhotons;
+		mNumPhotons = numPhotons;
+		if (mIrradianceMap)
+			mIrradianceMap->reset();
+	}
+
+	// Bump when the file layout or the way photons are traced changes
+	static const u32 PHOTON_CACHE_VERSION = 2;
+	static const char PHOTON_CACHE_MAGIC[8] = { 'T', 'K', 'P', 'H', 'O', 'T', 'O', 'N' };
+
+	struct PhotonCacheHeader
+	{
+		char magic[8];
+		u32 version;
+		s32 numIterations;
+		u64 key;
+	};
+
+	struct PhotonCacheIteration
+	{
+		s32 shootGlobal, shootCaustic;
+		s32 numGlobal, numCaustic;
+	};
+
+	PhotonMapCache::PhotonMapCache()
+		: mMapping(nullptr), mMappingSize(0), mWriter(nullptr), mNumWritten(0)
+	{
+	}
+
+	PhotonMapCache::~PhotonMapCache()
+	{
+		if (mWriter)
+			fclose(mWriter);
+		unmap();
+	}
+
+	void PhotonMapCache::unmap()
+	{
+		if (mMapping)
+		{
+#if (defined( __WIN32__ ) || defined( _WIN32 ))
+			UnmapViewOfFile(mMapping);
+#else
+			munmap((void*)mMapping, mMappingSize);
+#endif
 		}
+		mMapping = nullptr;
+		mMappingSize = 0;
+		mIterations.clear();
+	}
 
-		if (++median != end)
+	bool PhotonMapCache::open(const string& filename, u64 key, s32 numIterations)
+	{
+		unmap();
+#if (defined( __WIN32__ ) || defined( _WIN32 ))
+		HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER size;
+		GetFileSizeEx(file, &size);
+		HANDLE mapping = size.QuadPart > 0 ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+		CloseHandle(file);
+		if (!mapping)
+			return false;
+		mMapping = (const u8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		mMappingSize = (size_t)size.QuadPart;
+#else
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
 		{
-			++idx;
-			if (median + 1 != end)
+			void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED)
 			{
-				const float tmp = bbox.pMin[dim];
-				bbox.pMin[dim] = (*median)->pos[dim];
-				node->right = balance(median, end, idx);
-				bbox.pMin[dim] = tmp;
-			}
-			else {
-				KdTree* child = &root[idx];
-				child->pt = *median;
-				node->right = child;
+				mMapping = (const u8*)p;
+				mMappingSize = (size_t)st.st_size;
 			}
 		}
-		return node;
+		close(fd);
+#endif
+		if (!mMapping)
+			return false;
+
+		PhotonCacheHeader header;
+		if (mMappingSize < sizeof(header))
+		{
+			unmap();
+			return false;
+		}
+		memcpy(&header, mMapping, sizeof(header));
+		if (memcmp(header.magic, PHOTON_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+			header.version != PHOTON_CACHE_VERSION || header.key != key ||
+			header.numIterations < numIterations)
+		{
+			unmap();
+			return false;
+		}
+		size_t offset = sizeof(header);
+		for (s32 i = 0; i < numIterations; ++i)
+		{
+			PhotonCacheIteration it;
+			if (offset + sizeof(it) > mMappingSize)
+				break;
+			memcpy(&it, mMapping + offset, sizeof(it));
+			offset += sizeof(it);
+			size_t bytes = PhotonMap::serializedSize(it.numGlobal) + PhotonMap::serializedSize(it.numCaustic);
+			if (offset + bytes > mMappingSize)
+				break;
+			mIterations.push_back(Iteration{ mMapping + offset, it.shootGlobal, it.shootCaustic, it.numGlobal, it.numCaustic });
+			offset += bytes;
+		}
+		if ((s32)mIterations.size() < numIterations)
+		{
+			unmap();
+			return false;
+		}
+		mFilename = filename;
+		return true;
+	}
+
+	bool PhotonMapCache::attach(s32 iteration, PhotonMap& globalMap, PhotonMap& causticMap,
+		s32* shootGlobal, s32* shootCaustic)const
+	{
+		if (iteration >= (s32)mIterations.size())
+			return false;
+		const Iteration& it = mIterations[iteration];
+		globalMap.attach(it.data, it.numGlobal);
+		causticMap.attach(it.data + PhotonMap::serializedSize(it.numGlobal), it.numCaustic);
+		*shootGlobal = it.shootGlobal;
+		*shootCaustic = it.shootCaustic;
+		return true;
+	}
+
+	bool PhotonMapCache::create(const string& filename, u64 key)
+	{
+		if (mWriter)
+			fclose(mWriter);
+		mWriter = fopen(filename.c_str(), "wb");
+		if (!mWriter)
+			return false;
+		mFilename = filename;
+		mNumWritten = 0;
+		// The iteration count stays zero until finish, an interrupted file never matches
+		PhotonCacheHeader header;
+		memcpy(header.magic, PHOTON_CACHE_MAGIC, sizeof(header.magic));
+		header.version = PHOTON_CACHE_VERSION;
+		header.numIterations = 0;
+		header.key = key;
+		fwrite(&header, sizeof(header), 1, mWriter);
+		return true;
+	}
+
+	void PhotonMapCache::append(const PhotonMap& globalMap, const PhotonMap& causticMap, s32 shootGlobal, s32 shootCaustic)
+	{
+		if (!mWriter)
+			return;
+		PhotonCacheIteration it = { shootGlobal, shootCaustic, globalMap.stored(), causticMap.stored() };
+		if (fwrite(&it, sizeof(it), 1, mWriter) != 1 || !globalMap.save(mWriter) || !causticMap.save(mWriter))
+		{
+			fprintf(stderr, "\r[Tracer] Failed to write photon cache %s\n", mFilename.c_str());
+			fclose(mWriter);
+			mWriter = nullptr;
+			return;
+		}
+		++mNumWritten;
+	}
+
+	bool PhotonMapCache::finish()
+	{
+		if (!mWriter)
+			return false;
+		bool ok = fseek(mWriter, offsetof(PhotonCacheHeader, numIterations), SEEK_SET) == 0 &&
+			fwrite(&mNumWritten, sizeof(mNumWritten), 1, mWriter) == 1;
+		ok &= fclose(mWriter) == 0;
+		mWriter = nullptr;
+		return ok;
 	}
 }
\ No newline at end of file
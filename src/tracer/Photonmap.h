@@ -12,32 +12,89 @@ namespace tk
 { 
 	class PhotonMap {
 	private:
+		// Preallocated to the capacity, the first mNumPhotons are in use
 		std::vector<Photon> all_raw_photons;
 		GLuint geometry_array;
 		s32 mStoredPhotons;
+		s32 mNumPhotons;
 		s32 sampleCount;
 
-		float cosTheta[256];
-		float sinTheta[256];
-		float cosPhi[256];
-		float sinPhi[256];
-
-		KdTree* root;
+		// Left-balanced kd-tree, the photons are stored inline in SoA layout
+		std::vector<float> mNodePos[3];
+		std::vector<u32> mNodePower;
+		std::vector<u16> mNodeDir;
+		std::vector<u16> mNodeNormal;
+		KdTree mTree;
+		// Irradiance at a subset of the photons, stored as photons with the normal as
+		// direction. Empty unless precomputeIrradiance ran on the current photons.
+		std::unique_ptr<PhotonMap> mIrradianceMap;
+		float mIrradianceRadius2;
 		Bounds3 bbox;
 
-		KdTree* balance(std::vector<Photon*>::iterator start,
-			std::vector<Photon*>::iterator end, int& idx);
+		// Places the median of [start, end) along _dim_ at _node_
+		std::vector<s32>::iterator splitNode(std::vector<s32>::iterator start,
+			std::vector<s32>::iterator end, s32 node, int dim);
+		void balance(std::vector<s32>::iterator start, std::vector<s32>::iterator end,
+			s32 node, Bounds3 bounds);
 	public:
 		PhotonMap(s32 size, s32 sampleCount);
 		~PhotonMap();
 		s32 size()const { return mStoredPhotons; }
-		void reset() { all_raw_photons.clear(); }
-		bool storePhoton(Vector3f pos, Spectrum power, u8 theta, u8 phi, s32& num);
+		s32 stored()const { return mNumPhotons; }
+		void reset();
+		// Copies _count_ photons to the slots from _offset_ on, disjoint ranges may be
+		// stored concurrently. setStored publishes the number of photons in use.
+		void storePhotons(s32 offset, const Photon* photons, s32 count);
+		void setStored(s32 count) { mNumPhotons = std::min(count, mStoredPhotons); }
 		void update_photons();
 		/// Organize the photons into some sort of kd-tree
 		void buildKdTree();
 		void render_photons();
 		Spectrum radiance_estimate(const Intersection& isect, float& maxRadius2, int& found)const;
+		// Estimates irradiance at every _stride_th kd-tree node from its sampleCount nearest
+		// photons. radiance_estimate on diffuse surfaces then only looks up the nearest of
+		// these, the search radius is bounded by _maxRadius2_.
+		s32 precomputeIrradiance(s32 stride, float maxRadius2);
+
+		// Bytes written by save
+		static size_t serializedSize(s32 numPhotons);
+		// Writes the kd-tree arrays, a later attach can use them in place
+		bool save(FILE* fp)const;
+		// Gathers from kd-tree arrays laid out by save, _data_ must outlive the map's use
+		void attach(const u8* data, s32 numPhotons);
+	};
+
+	// File of the photon maps of every SPPM iteration, keyed by the scene content and the
+	// photon settings. Existing files are memory-mapped and the maps attached in place.
+	class PhotonMapCache
+	{
+	private:
+		struct Iteration
+		{
+			const u8* data;
+			s32 shootGlobal, shootCaustic;
+			s32 numGlobal, numCaustic;
+		};
+		std::vector<Iteration> mIterations;
+		const u8* mMapping;
+		size_t mMappingSize;
+		FILE* mWriter;
+		string mFilename;
+		s32 mNumWritten;
+
+		void unmap();
+	public:
+		PhotonMapCache();
+		~PhotonMapCache();
+		// Maps _filename_, false if it is missing or stores another key or fewer iterations
+		bool open(const string& filename, u64 key, s32 numIterations);
+		bool attach(s32 iteration, PhotonMap& globalMap, PhotonMap& causticMap,
+			s32* shootGlobal, s32* shootCaustic)const;
+		// Starts a new file, it only becomes valid once finish has written all iterations
+		bool create(const string& filename, u64 key);
+		void append(const PhotonMap& globalMap, const PhotonMap& causticMap, s32 shootGlobal, s32 shootCaustic);
+		bool finish();
+		bool writing()const { return mWriter != nullptr; }
 	};
 }
 
@@ -76,8 +76,8 @@ namespace tk
 		}
 	};
 
-	BdptTracer::BdptTracer(s32 spp, s32 maxDepth, s32 numThreads, Real russianRoulette, s32 debugS, s32 debugT, bool debugNoMIS)
-		: RayTracer(spp, maxDepth, numThreads, russianRoulette),
+	BdptTracer::BdptTracer(s32 spp, s32 maxDepth, Real russianRoulette, s32 debugS, s32 debugT, bool debugNoMIS)
+		: RayTracer(spp, maxDepth, russianRoulette),
 		mDebugS(debugS), mDebugT(debugT),
 		mDebugNoMIS(debugNoMIS)
 	{
@@ -97,14 +97,16 @@ namespace tk
 
 	void BdptTracer::rendering()
 	{
+		// The calling thread traces tiles too, with one thread there are no pool workers
+		traceNextTile(*mSampler);
 		fprintf(stderr, "\r[Tracer] Rendering...... %02d%%", std::min(int((Real)(mJobsDone) / mJobsCount * 100), 100));
-		if (mNextStart.y >= mEndPos.y)
+		if (mJobsDone >= mJobsCount)
 		{
 			stopRaytracing();
 			mState = DONE;
 
 		}
-		mFilm->setFrame(mFrameBuffer);
+		mFilm->setFrame(mFrameBuffer, getSplatScale());
 		glDrawPixels(mEndPos.x, mEndPos.y, GL_RGBA,
 			GL_UNSIGNED_BYTE, mFrameBuffer);
 	}
@@ -131,8 +133,8 @@ namespace tk
 		const std::vector<std::shared_ptr<AreaLight>>& lights = mScene->get_lights();
 		int numLights = lights.size();
 		if (numLights == 0) return 0;
-		int idx = std::min<s32>(s.get1D() * numLights, numLights - 1);
-		Real pdfChoice = 1.0f / numLights;
+		Real pdfChoice;
+		int idx = mScene->sampleLight(s.get1D(), &pdfChoice);
 		Real pdfPos, pdfDir;
 		Ray r;
 		Vector3f n;
@@ -237,8 +239,8 @@ namespace tk
 			const std::vector<std::shared_ptr<AreaLight>>& lights = mScene->get_lights();
 			int numLights = lights.size();
 			if (numLights == 0) return Spectrum::black;
-			int idx = std::min<int>(sampler.get1D() * numLights, numLights - 1);
-			Real pdfChoice = 1.0f / numLights;
+			Real pdfChoice;
+			int idx = mScene->sampleLight(sampler.get1D(), &pdfChoice);
 			Real pdfLight;	// pdfPos * squaredDistance(t, s) / AbsDot(wi, nLight)
 			Vector3f wi;
 			Spectrum Le = lights[idx]->sample_Li(vt.isect, sampler.get1D(), sampler.get2D(), &sampled.isect, &wi, &pdfLight);
@@ -310,7 +312,7 @@ namespace tk
 		if (s == 0)
 		{
 			Real pdfChoice, pdfPos, pdfDir;
-			pdfChoice = 1.0f / mScene->get_lights().size();
+			pdfChoice = mScene->lightPdf(vt->isect.obj->getAreaLight());
 			vt->isect.obj->getAreaLight()->pdf_Le(Ray(vt->isect.p, vt->isect.wo), vt->isect.n, &pdfPos, &pdfDir);
 
 			a2 = { &vt->pdfRev, pdfChoice * pdfPos };
@@ -389,54 +391,39 @@ namespace tk
 	void BdptTracer::traceTile(Point2i start, Point2i end, Sampler& sampler)
 	{
 		std::unique_ptr<FilmTile> filmTile = mFilm->getFilmTile(Bounds2i(start, end));
-		for (s32 y = start.y; y < end.y; ++y)
-		{
-			for (s32 x = start.x; x < end.x; ++x)
-			{
-				Point2i pixel = Point2i(x, y);
-				sampler.startPixel(pixel);
-				RayPath eyePath(mMaxDepth + 1);
-				RayPath lightPath(mMaxDepth + 1);
-				do
-				{
-					Vector2f cameraSample = sampler.get2D() + Vector2f(pixel.x, pixel.y);
-					Ray r;
-					mCamera->generateRay(cameraSample, sampler.get2D(), &r);
+		RayPath eyePath(mMaxDepth + 1);
+		RayPath lightPath(mMaxDepth + 1);
+		traceTileSamples(start, end, sampler, filmTile.get(), [&](const Point2i& pixel) {
+			Vector2f cameraSample = sampler.get2D() + Vector2f(pixel.x, pixel.y);
+			Ray r;
+			mCamera->generateRay(cameraSample, sampler.get2D(), &r);
 					
-					s32 ne = generateCameraSubpath(6, r, eyePath, sampler);
-					s32 nl = generateLightSubpath(6, lightPath, sampler);
+			s32 ne = generateCameraSubpath(6, r, eyePath, sampler);
+			s32 nl = generateLightSubpath(6, lightPath, sampler);
 				
-					Spectrum L;
-					for (s32 t = 1; t <= ne; ++t)
-					{
-						for (s32 s = 0; s <= nl; ++s)
-						{
-							s32 depth = t + s - 2;
-							if ((s == 1 && t == 1) || depth < 0 || depth > mMaxDepth * 2)
-								continue;
-							if (((mDebugS != -1) && (mDebugS != s)) ||
-								((mDebugT != -1) && (mDebugT != t)))
-								continue;
-							Vector2f raster;
-							Spectrum Lpath = connectPath(eyePath, lightPath, s, t, sampler, &raster);
-							if (Lpath == Spectrum::black)
-								continue;
-							if (t != 1)
-								L += Lpath;
-							else
-							{
-								mutex1.lock();
-								mFilm->addSplat(raster, Lpath / mSpp);
-								mutex1.unlock();
-							}
-						}
-					}			
-					filmTile->addSample(cameraSample, L);
-				} while (sampler.startNextSample());
-			}
-		}
-		mutex1.lock();
+			Spectrum L;
+			for (s32 t = 1; t <= ne; ++t)
+			{
+				for (s32 s = 0; s <= nl; ++s)
+				{
+					s32 depth = t + s - 2;
+					if ((s == 1 && t == 1) || depth < 0 || depth > mMaxDepth * 2)
+						continue;
+					if (((mDebugS != -1) && (mDebugS != s)) ||
+						((mDebugT != -1) && (mDebugT != t)))
+						continue;
+					Vector2f raster;
+					Spectrum Lpath = connectPath(eyePath, lightPath, s, t, sampler, &raster);
+					if (Lpath == Spectrum::black)
+						continue;
+					if (t != 1)
+						L += Lpath;
+					else
+						mFilm->addSplat(raster, Lpath / mSpp);
+				}
+			}			
+			filmTile->addSample(cameraSample, L);
+		});
 		mFilm->mergeFilmTile(std::move(filmTile));
-		mutex1.unlock();	
 	}
 }
\ No newline at end of file
@@ -34,7 +34,7 @@ namespace tk
 			PathVertex& sampled);
 		void traceTile(Point2i start, Point2i end, Sampler& sampler);
 	public:
-		BdptTracer(s32 spp, s32 maxDepth, s32 numThreads, Real russianRoulette, s32 debugS, s32 debugT,
+		BdptTracer(s32 spp, s32 maxDepth, Real russianRoulette, s32 debugS, s32 debugT,
 			bool debugNoMIS);
 	};
 }
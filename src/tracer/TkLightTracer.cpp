@@ -10,8 +10,8 @@
 
 namespace tk
 {
-	LightTracer::LightTracer(s32 spp, s32 maxDepth, s32 numThreads, Real russianRoulette)
-		: RayTracer(spp, maxDepth, numThreads, russianRoulette)
+	LightTracer::LightTracer(s32 spp, s32 maxDepth, Real russianRoulette)
+		: RayTracer(spp, maxDepth, russianRoulette)
 	{
 		s32 x = 1, y = mSpp / x;
 		while ((y != x) && (y / x != 2))
@@ -29,31 +29,25 @@ namespace tk
 
 	void LightTracer::rendering()
 	{
+		// The calling thread traces tiles too, with one thread there are no pool workers
+		traceNextTile(*mSampler);
 		fprintf(stderr, "\r[Tracer] Rendering...... %02d%%", std::min(int((Real)(mJobsDone) / mJobsCount * 100), 100));
-		if (mNextStart.y >= mEndPos.y)
+		if (mJobsDone >= mJobsCount)
 		{
 			stopRaytracing();
 			mState = DONE;
 		}
-		mFilm->setFrame(mFrameBuffer);
+		mFilm->setFrame(mFrameBuffer, getSplatScale());
 		glDrawPixels(mEndPos.x, mEndPos.y, GL_RGBA,
 			GL_UNSIGNED_BYTE, mFrameBuffer);
 	}
 
 	void LightTracer::traceTile(Point2i start, Point2i end, Sampler& sampler)
 	{
-		for (s32 y = start.y; y < end.y; ++y)
-		{
-			for (s32 x = start.x; x < end.x; ++x)
-			{
-				Point2i pixel = Point2i(x, y);
-				sampler.startPixel(pixel);
-				do {
-					RayPath path;
-					splatFilmT1(pixel, sampler, path);
-				} while (sampler.startNextSample());
-			}
-		}
+		traceTileSamples(start, end, sampler, nullptr, [&](const Point2i& pixel) {
+			RayPath path;
+			splatFilmT1(pixel, sampler, path);
+		});
 	}
 
 	s32 LightTracer::generateLightSubpath(RayPath& path, Sampler& s)
@@ -61,8 +55,8 @@ namespace tk
 		const std::vector<std::shared_ptr<AreaLight>>& lights = mScene->get_lights();
 		int numLights = lights.size();
 		if (numLights == 0) return 0;
-		int idx = std::min<s32>(s.get1D() * numLights, numLights - 1);
-		float pdf = 1.0f / numLights;
+		float pdf;
+		int idx = mScene->sampleLight(s.get1D(), &pdf);
 		float pdfPos, pdfDir;
 		Ray r;
 		Vector3f n;
@@ -178,9 +172,7 @@ namespace tk
 			}
 
 			Spectrum contribution = fsL * fsE * G * pv.throughput * v.throughput;
-			mutex1.lock();
 			mFilm->addSplat(raster, contribution / mSpp);
-			mutex1.unlock();
 		}
 	}
 
@@ -189,8 +181,8 @@ namespace tk
 		const std::vector<std::shared_ptr<AreaLight>>& lights = mScene->get_lights();
 		int numLights = lights.size();
 		if (numLights == 0) return;
-		int idx = std::min<s32>(sampler.get1D() * numLights, numLights - 1);
-		float pdf = 1.0f / numLights;
+		float pdf;
+		int idx = mScene->sampleLight(sampler.get1D(), &pdf);
 		float pdfPos, pdfDir;
 		Ray r;
 		Vector3f n;
@@ -229,9 +221,7 @@ namespace tk
 			G *= AbsDot(n, wi);
 
 			Spectrum contribution = fsL * fsE * G * pv.throughput * lv.throughput;
-			mutex1.lock();
 			mFilm->addSplat(raster, contribution / mSpp);
-			mutex1.unlock();
 		}
 	}
 }
\ No newline at end of file
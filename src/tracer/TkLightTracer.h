@@ -45,7 +45,7 @@ namespace tk
 		void splatFilmT1(Point2i pixel, Sampler& sampler, RayPath& path);
 		void splatFilmS1(Point2i pixel, Sampler& sampler, RayPath& path);
 	public:
-		LightTracer(s32 spp, s32 maxDepth, s32 numThreads, Real russianRoulette);
+		LightTracer(s32 spp, s32 maxDepth, Real russianRoulette);
 	};
 }
 #endif
\ No newline at end of file
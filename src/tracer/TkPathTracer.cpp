@@ -10,8 +10,9 @@
 
 namespace tk
 {
-	PathTracer::PathTracer(s32 spp, s32 maxDepth, s32 numThreads, Real russianRoulette)
-		: RayTracer(spp, maxDepth, numThreads, russianRoulette)
+	PathTracer::PathTracer(s32 spp, s32 maxDepth, Real russianRoulette, s32 lightSamples)
+		: RayTracer(spp, maxDepth, russianRoulette),
+		mLightSamples(lightSamples)
 	{
 		s32 x = 1, y = mSpp / x;
 		while ((y != x) && (y / x != 2))
@@ -20,9 +21,20 @@ namespace tk
 			y = mSpp / x;
 		}
 		mSampler = new StratifiedSampler(x, y, true);
+		requestSamples(mSampler);
 		mSelectionHistory.push_back(0);
 	}
 
+	void PathTracer::requestSamples(Sampler* sampler)
+	{
+		if (mLightSamples <= 1)
+			return;
+		mLightSamples = sampler->roundCount(mLightSamples);
+		sampler->request1DArray(mLightSamples);
+		sampler->request2DArray(mLightSamples);
+		sampler->request1DArray(mLightSamples);
+	}
+
 	void PathTracer::keyPress(s32 key)
 	{
 		BVHAccel* bvh = mScene->getBVH();
@@ -113,8 +125,10 @@ namespace tk
 
 	void PathTracer::rendering()
 	{
+		// The calling thread traces tiles too, with one thread there are no pool workers
+		traceNextTile(*mSampler);
 		fprintf(stderr, "\r[Tracer] Rendering...... %02d%%", std::min(int((Real)(mJobsDone) / mJobsCount * 100), 100));
-		if (mNextStart.y >= mEndPos.y)
+		if (mJobsDone >= mJobsCount)
 		{
 			stopRaytracing();
 			mState = DONE;
@@ -127,31 +141,22 @@ namespace tk
 	void PathTracer::traceTile(Point2i start, Point2i end, Sampler& sampler)
 	{
 		std::unique_ptr<FilmTile> filmTile = mFilm->getFilmTile(Bounds2i(start, end));
-		for (s32 y = start.y; y < end.y; ++y)
-		{
-			for (s32 x = start.x; x < end.x; ++x)
-			{
-				Point2i pixel = Point2i(x, y);
-				sampler.startPixel(pixel);
-				do {
-					Vector2f cameraSample = sampler.get2D() + Vector2f(pixel.x, pixel.y);
-					Ray r;
-					mCamera->generateRay(cameraSample, sampler.get2D(), &r);
-					filmTile->addSample(cameraSample, Li(r, sampler));
-				} while (sampler.startNextSample());
-			}
-		}
-		mutex1.lock();
+		traceTileSamples(start, end, sampler, filmTile.get(), [&](const Point2i& pixel) {
+			Vector2f cameraSample = sampler.get2D() + Vector2f(pixel.x, pixel.y);
+			Ray r;
+			mCamera->generateRay(cameraSample, sampler.get2D(), &r);
+			filmTile->addSample(cameraSample, Li(r, sampler));
+		});
 		mFilm->mergeFilmTile(std::move(filmTile));
-		mutex1.unlock();
 	}
 
 	Spectrum PathTracer::Li(Ray& r, Sampler& sampler, s32 depth)const
 	{
 		Spectrum L(0, 0, 0), beta(1, 1, 1);
-		Intersection inter;
+		Intersection inter, prev;
 		s32 bounces;
 		bool test = true;
+		float pdf = 0;
 		for (bounces = 0; bounces < mMaxDepth; ++bounces)
 		{
 			if (!mScene->intersect(r, &inter))
@@ -159,13 +164,33 @@ namespace tk
 			Vector3f wo = -r.direction;
 			const Material* m = inter.obj->getMaterial();
 			m->setTransportMode(Radiance);
-			if (test)
-				L += beta * inter.Le(wo);
-			L += beta * mScene->uniformSampleOneLight(inter, sampler);
+			// Emission found by BSDF sampling shares the light with next-event estimation
+			Spectrum Le = inter.Le(wo);
+			if (Le != Spectrum::black)
+				L += beta * Le * (test ? 1 : powerHeuristic(1, pdf, 1, mScene->pdfLi(prev, inter)));
+			const Real* uChoice = nullptr;
+			const Vector2f* uLight = nullptr;
+			const Real* u0 = nullptr;
+			if (bounces == 0 && mLightSamples > 1)
+			{
+				uChoice = sampler.get1DArray(mLightSamples);
+				uLight = sampler.get2DArray(mLightSamples);
+				u0 = sampler.get1DArray(mLightSamples);
+			}
+			if (uChoice && uLight && u0)
+			{
+				// Each light sample keeps its one-sample MIS weight, the weights against the
+				// BSDF sample still sum to one so the average stays unbiased
+				Spectrum Ld(0, 0, 0);
+				for (s32 i = 0; i < mLightSamples; ++i)
+					Ld += mScene->sampleOneLight(inter, uChoice[i], uLight[i], u0[i], true);
+				L += beta * Ld / (Real)mLightSamples;
+			}
+			else
+				L += beta * mScene->sampleOneLight(inter, sampler, true);
 			if (get_random_float() > mRussianRoulette)
 				break;
 			Vector3f wi;
-			float pdf;
 			Spectrum f = m->sample_f(wo, &wi, inter.n, sampler.get2D(), &pdf);
 			if (pdf == 0 || f == Spectrum::black)
 				break;
@@ -173,6 +198,7 @@ namespace tk
 				fprintf(stderr, "\nmaterial nan\n");
 			test = m->getType() & (GLASS | MIRROR);
 			beta *= f * AbsDot(wi, inter.n) / (pdf * mRussianRoulette);
+			prev = inter;
 			r = inter.spawnRay(wi);
 			/*Volume* volume = 0;
 			if (m->hasVolume())
@@ -9,12 +9,15 @@ namespace tk
 	{
 	protected:
 		std::vector<s32> mSelectionHistory;
+		// Light samples taken at the first vertex, drawn from the sampler's arrays
+		s32 mLightSamples;
 		void visualize();
 		void rendering();
 		Spectrum Li(Ray& r, Sampler& sampler, s32 depth = 0)const;
 		void traceTile(Point2i start, Point2i end, Sampler& sampler);
+		void requestSamples(Sampler* sampler);
 	public:
-		PathTracer(s32 spp, s32 maxDepth, s32 numThreads, Real russianRoulette);
+		PathTracer(s32 spp, s32 maxDepth, Real russianRoulette, s32 lightSamples = 1);
 		void keyPress(s32 key);
 	};
 }
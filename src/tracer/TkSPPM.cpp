@@ -0,0 +1,526 @@
+#include "TkSPPM.h"
+#include "Scene.hpp"
+#include "Object.hpp"
+#include "Material.hpp"
+#include "sampler.h"
+#include "Bounds3.hpp"
+#include "TkLowdiscrepancy.h"
+#include "TkRng.h"
+#include "camera.h"
+#include <GL/glew.h>
+#include <xmmintrin.h>
+#include <chrono>
+#include <mutex>
+
+namespace tk
+{
+	void VisiblePoints::resize(s32 numPixels, Real initRadius)
+	{
+		size = numPixels;
+		posX.assign(numPixels, 0);
+		posY.assign(numPixels, 0);
+		posZ.assign(numPixels, 0);
+		radius.assign(numPixels, initRadius);
+		N.assign(numPixels, 0);
+		for (int c = 0; c < 3; ++c)
+		{
+			Phi[c].assign(numPixels, 0);
+			Tau[c].assign(numPixels, 0);
+			throughput[c].assign(numPixels, 0);
+		}
+		M.assign(numPixels, 0);
+		shading.assign(numPixels, VisiblePointShading());
+		Ld.assign(numPixels, Spectrum::black);
+	}
+
+	// Entry of a cell list, both links are indices so that a node is 8 bytes
+	struct PixelListNode
+	{
+		s32 pixel;
+		s32 next;
+	};
+
+	class SpatialHashGrids
+	{
+	private:
+		// Heads of the per cell lists, pushed with compare-exchange while building
+		std::unique_ptr<std::atomic<s32>[]> mGrids;
+		std::vector<PixelListNode> mNodes;
+		Bounds3 mGridsBounds;
+		s32 mGridsRes[3];
+		size_t mHashSize;
+
+		size_t hash(s32 x, s32 y, s32 z)const;
+		void pointBounds(const VisiblePoints& points, s32 i, s32* pMin, s32* pMax)const;
+
+	public:
+		SpatialHashGrids(s32 pixelSize);
+
+		void rebuild(const VisiblePoints& points);
+		bool worldToGrid(const Vector3f& p,
+			s32* pi)const;
+		// First node of the cell containing p, -1 if there is none
+		s32 getGrid(const Vector3f& p)const;
+		const PixelListNode& getNode(s32 idx)const { return mNodes[idx]; }
+	};
+
+	SpatialHashGrids::SpatialHashGrids(s32 pixelSize)
+		: mGrids(new std::atomic<s32>[pixelSize]), mHashSize(pixelSize)
+	{
+		for (size_t i = 0; i < mHashSize; ++i)
+			mGrids[i] = -1;
+		mGridsRes[0] = mGridsRes[1] = mGridsRes[2] = 1;
+	}
+
+	void SpatialHashGrids::pointBounds(const VisiblePoints& points, s32 i, s32* pMin, s32* pMax)const
+	{
+		Vector3f p(points.posX[i], points.posY[i], points.posZ[i]);
+		worldToGrid(p - Vector3f(points.radius[i]), pMin);
+		worldToGrid(p + Vector3f(points.radius[i]), pMax);
+	}
+
+	void SpatialHashGrids::rebuild(const VisiblePoints& points)
+	{
+		s32 numPixels = points.size;
+		Parrallel::parrallelFor(0, (s32)mHashSize, [&](s32 start, s32 end) {
+			for (s32 i = start; i < end; ++i)
+				mGrids[i].store(-1, std::memory_order_relaxed);
+		});
+
+		// Bounds of the visible points, reduced over chunks
+		std::mutex boundsMutex;
+		mGridsBounds = Bounds3();
+		Real maxRadius = 0;
+		Parrallel::parrallelFor(0, numPixels, [&](s32 start, s32 end) {
+			Bounds3 b;
+			Real r = 0;
+			for (s32 i = start; i < end; ++i)
+			{
+				if (!points.valid(i))
+					continue;
+				Vector3f p(points.posX[i], points.posY[i], points.posZ[i]);
+				b = Union(b, p - Vector3f(points.radius[i]));
+				b = Union(b, p + Vector3f(points.radius[i]));
+				r = tk::max(r, points.radius[i]);
+			}
+			std::lock_guard<std::mutex> lock(boundsMutex);
+			mGridsBounds = Union(mGridsBounds, b);
+			maxRadius = tk::max(maxRadius, r);
+		});
+		mNodes.clear();
+		if (maxRadius <= 0)
+			return;
+
+		Vector3f diag = mGridsBounds.Diagonal();
+		Real maxDiag = diag[mGridsBounds.maxExtent()];
+		s32 baseGridRes = std::max((s32)(maxDiag / maxRadius), 1);
+		for (int i = 0; i < 3; ++i)
+			mGridsRes[i] = std::max((s32)(baseGridRes * diag[i] / maxDiag), 1);
+
+		// Every pixel knows how many cells it overlaps, so the list nodes are
+		// allocated up front and each pixel writes its own range of them
+		std::vector<s32> offsets(numPixels + 1, 0);
+		Parrallel::parrallelFor(0, numPixels, [&](s32 start, s32 end) {
+			for (s32 i = start; i < end; ++i)
+			{
+				if (!points.valid(i))
+					continue;
+				s32 pMin[3], pMax[3];
+				pointBounds(points, i, pMin, pMax);
+				offsets[i + 1] = (pMax[0] - pMin[0] + 1) * (pMax[1] - pMin[1] + 1) * (pMax[2] - pMin[2] + 1);
+			}
+		});
+		for (s32 i = 0; i < numPixels; ++i)
+			offsets[i + 1] += offsets[i];
+		mNodes.resize(offsets[numPixels]);
+
+		Parrallel::parrallelFor(0, numPixels, [&](s32 start, s32 end) {
+			for (s32 i = start; i < end; ++i)
+			{
+				if (!points.valid(i))
+					continue;
+				s32 pMin[3], pMax[3];
+				pointBounds(points, i, pMin, pMax);
+				s32 node = offsets[i];
+				for (s32 z = pMin[2]; z <= pMax[2]; ++z)
+					for (s32 y = pMin[1]; y <= pMax[1]; ++y)
+						for (s32 x = pMin[0]; x <= pMax[0]; ++x, ++node)
+						{
+							std::atomic<s32>& head = mGrids[hash(x, y, z)];
+							mNodes[node].pixel = i;
+							mNodes[node].next = head.load(std::memory_order_relaxed);
+							while (!head.compare_exchange_weak(mNodes[node].next, node, std::memory_order_relaxed));
+						}
+			}
+		});
+	}
+
+	bool SpatialHashGrids::worldToGrid(const Vector3f& p,
+		s32* pi)const
+	{
+		bool inBounds = true;
+		Vector3f pg = mGridsBounds.Offset(p);
+		for (s32 i = 0; i < 3; ++i) {
+			pi[i] = (s32)(mGridsRes[i] * pg[i]);
+			inBounds &= (pi[i] >= 0 && pi[i] < mGridsRes[i]);
+			pi[i] = Math::Clamp(pi[i], 0, mGridsRes[i] - 1);
+		}
+		return inBounds;
+	}
+
+	s32 SpatialHashGrids::getGrid(const Vector3f& p)const
+	{
+		s32 pi[3];
+		if (mNodes.empty() || !worldToGrid(p, pi))
+			return -1;
+		return mGrids[hash(pi[0], pi[1], pi[2])].load(std::memory_order_relaxed);
+	}
+
+	size_t SpatialHashGrids::hash(s32 x, s32 y, s32 z)const
+	{
+		return (((u32)x * 73856093u) ^ ((u32)y * 19349663u) ^ ((u32)z * 83492791u)) % mHashSize;
+	}
+
+	SPPM::SPPM(s32 spp, s32 maxDepth, Real russianRoulette, SPPMParam param)
+		: RayTracer(spp, maxDepth, russianRoulette),
+		radius(param.radius2),
+		numIteration(param.numRecurse),
+		photonsPerIt(param.globalSize),
+		curIteration(0)
+	{
+		s32 x = 0, y = 0;
+		while (++x * ++y < numIteration);
+		numIteration = x * y;
+		mSampler = new StratifiedSampler(x, y, true);
+	}
+
+	SPPM::~SPPM()
+	{
+	}
+
+	void SPPM::visualize()
+	{
+
+	}
+
+	Spectrum SPPM::getRadiance(s32 pixel, s32 iterations)const
+	{
+		const VisiblePoints& vp = mPoints;
+		Real radius = vp.radius[pixel];
+		return vp.Ld[pixel] / iterations + Spectrum(vp.Tau[0][pixel], vp.Tau[1][pixel], vp.Tau[2][pixel]) /
+			((Real)iterations * photonsPerIt * Math::pi * radius * radius);
+	}
+
+	void SPPM::rendering()
+	{
+		if (mState == RENDERING)
+		{
+			iterate();
+			fprintf(stderr, "\r[Tracer] Iteration %d... Done!\n", curIteration);
+			if (++curIteration >= numIteration)
+			{
+				fprintf(stderr, "\r[Tracer] Rendering Done!");
+				mState = DONE;
+			}
+			for (s32 i = 0; i < mEndPos.x * mEndPos.y; ++i)
+			{
+				Spectrum c = getRadiance(i, curIteration);
+				u32 v = 0;
+				v |= (u32)(255 * Math::Pow(Math::Clamp(c.b, 0.0f, 1.0f), 0.6)) << 16;
+				v |= (u32)(255 * Math::Pow(Math::Clamp(c.g, 0.0f, 1.0f), 0.6)) << 8;
+				v |= (u32)(255 * Math::Pow(Math::Clamp(c.r, 0.0f, 1.0f), 0.6));
+				v |= 0xFF000000;
+				mFrameBuffer[i] = v;
+			}
+		}
+		glDrawPixels(mEndPos.x, mEndPos.y, GL_RGBA,
+			GL_UNSIGNED_BYTE, mFrameBuffer);
+	}
+
+	void SPPM::traceTile(Point2i start, Point2i end, Sampler& sampler)
+	{
+		for (s32 y = start.y; y < end.y; ++y)
+		{
+			for (s32 x = start.x; x < end.x; ++x)
+			{
+				sampler.startPixelSample(Point2i(x, y), curIteration);
+				Vector2f cameraSample = sampler.get2D() + Vector2f(x, y);
+				Ray r;
+				mCamera->generateRay(cameraSample, sampler.get2D(), &r);
+				s32 pixel = x + y * mEndPos.x;
+				VisiblePoints& vp = mPoints;
+				Spectrum coef(1.f, 1.f, 1.f);
+				Intersection isect;
+				bool hasSpecular = true;
+
+				for (int i = 0; i < mMaxDepth; ++i)
+				{
+					if (!mScene->intersect(r, &isect))
+						break;
+					const Material* m = isect.obj->getMaterial();
+					m->setTransportMode(Radiance);
+					bool isDiffuse = m->getType() == DIFFUSE;
+					Vector3f wo = -r.direction;
+					if (hasSpecular)
+						vp.Ld[pixel] += coef * isect.Le(wo) / mSpp;
+					vp.Ld[pixel] += coef * mScene->sampleOneLight(isect, sampler) / mSpp;
+					if (isDiffuse)
+					{
+						vp.posX[pixel] = isect.p.x;
+						vp.posY[pixel] = isect.p.y;
+						vp.posZ[pixel] = isect.p.z;
+						vp.shading[pixel].material = m;
+						vp.shading[pixel].wo = isect.wo;
+						vp.shading[pixel].n = isect.n;
+						vp.throughput[0][pixel] = coef.r;
+						vp.throughput[1][pixel] = coef.g;
+						vp.throughput[2][pixel] = coef.b;
+						break;
+					}
+					hasSpecular &= (m->getType() & (MIRROR | GLASS)) != 0;
+					Vector3f wi;
+					float pdf;
+					Spectrum f = m->sample_f(wo, &wi, isect.n, sampler.get2D(), &pdf);
+					if (f == Spectrum::black || pdf == 0)
+						break;
+					coef = coef * f * AbsDot(wi, isect.n) / pdf;
+					r = isect.spawnRay(wi);
+				}
+			}
+		}
+	}
+
+	void SPPM::tracePhoton(u64 haltonIdx, std::vector<PhotonDeposit>& deposits)
+	{
+		s32 haltonDim = 0;
+		const std::vector<std::shared_ptr<AreaLight>>& lights = mScene->get_lights();
+		int numLights = lights.size();
+		if (numLights == 0) return;
+		float pdf;
+		int lightIdx = mScene->sampleLight(RadicalInverse(haltonDim++, haltonIdx), &pdf);
+		float pos_pdf, dir_pdf;
+		Ray r;
+		Vector3f normal;
+		Vector2f uLight0(RadicalInverse(haltonDim, haltonIdx), RadicalInverse(haltonDim + 1, haltonIdx));
+		Vector2f uLight1(RadicalInverse(haltonDim + 2, haltonIdx), RadicalInverse(haltonDim + 3, haltonIdx));
+		haltonDim += 4;
+		Spectrum weight = lights[lightIdx]->sample_Le(uLight0, uLight1, 0, &r, &normal, &pos_pdf, &dir_pdf);
+
+		if (pos_pdf == 0 || dir_pdf == 0)
+			return;
+		weight = weight * AbsDot(r.direction, normal) / (pos_pdf * dir_pdf * pdf);
+		RNG rng(haltonIdx);
+		for (s32 i = 0; i < mMaxDepth; ++i)
+		{
+			Intersection isect;
+			if (!mScene->intersect(r, &isect))
+				break;
+			Vector3f wo = -r.direction;
+			if (i > 0)
+			{
+				VisiblePoints& vp = mPoints;
+				for (s32 idx = mHashGrids->getGrid(isect.p); idx >= 0; )
+				{
+					const PixelListNode& node = mHashGrids->getNode(idx);
+					idx = node.next;
+					s32 pixel = node.pixel;
+					float dx = vp.posX[pixel] - isect.p.x;
+					float dy = vp.posY[pixel] - isect.p.y;
+					float dz = vp.posZ[pixel] - isect.p.z;
+					if (dx * dx + dy * dy + dz * dz <= vp.radius[pixel] * vp.radius[pixel])
+					{
+						const VisiblePointShading& sp = vp.shading[pixel];
+						sp.material->setTransportMode(Radiance);
+						Spectrum Phi = sp.material->f(sp.wo, wo, sp.n) * weight;
+						deposits.push_back(PhotonDeposit{ pixel, { Phi.r, Phi.g, Phi.b } });
+					}
+				}
+			}
+
+			if (rng.uniformFloat() > mRussianRoulette)
+				break;
+			Vector3f wi;
+			float pdf = 0;
+			Vector2f uBsdf(RadicalInverse(haltonDim, haltonIdx), RadicalInverse(haltonDim + 1, haltonIdx));
+			haltonDim += 2;
+			const Material* m = isect.obj->getMaterial();
+			m->setTransportMode(Importance);
+			Spectrum f = m->sample_f(wo, &wi, isect.n, uBsdf, &pdf);
+			if (pdf == 0 || f == Spectrum::black)
+				break;
+			weight = weight * f * AbsDot(wi, isect.n) / (pdf * mRussianRoulette);
+			r = isect.spawnRay(wi);
+		}
+	}
+
+	void SPPM::updatePixel(s32 start, s32 end)
+	{
+		const Real alpha = 0.7f;
+		VisiblePoints& vp = mPoints;
+		s32 i = start;
+		// Four visible points at a time, (R_i+1 / R_i)^2 = N_i+1 / (N_i + M) and points
+		// without photons keep a ratio of one. Phi is zero wherever M is.
+		const __m128 vAlpha = _mm_set1_ps(alpha);
+		const __m128 vOne = _mm_set1_ps(1.f);
+		for (; i + 4 <= end; i += 4)
+		{
+			float M[4];
+			for (s32 k = 0; k < 4; ++k)
+			{
+				M[k] = (float)vp.M[i + k];
+				vp.M[i + k] = 0;
+			}
+			__m128 vM = _mm_loadu_ps(M);
+			__m128 vN = _mm_loadu_ps(&vp.N[i]);
+			__m128 hit = _mm_cmpgt_ps(vM, _mm_setzero_ps());
+			__m128 newN = _mm_add_ps(vN, _mm_mul_ps(vAlpha, vM));
+			__m128 ratio = _mm_div_ps(newN, _mm_max_ps(_mm_add_ps(vN, vM), _mm_set1_ps(1e-20f)));
+			ratio = _mm_or_ps(_mm_and_ps(hit, ratio), _mm_andnot_ps(hit, vOne));
+			_mm_storeu_ps(&vp.N[i], newN);
+			_mm_storeu_ps(&vp.radius[i], _mm_mul_ps(_mm_loadu_ps(&vp.radius[i]), _mm_sqrt_ps(ratio)));
+			for (s32 c = 0; c < 3; ++c)
+			{
+				__m128 tau = _mm_add_ps(_mm_loadu_ps(&vp.Tau[c][i]),
+					_mm_mul_ps(_mm_loadu_ps(&vp.throughput[c][i]), _mm_loadu_ps(&vp.Phi[c][i])));
+				_mm_storeu_ps(&vp.Tau[c][i], _mm_mul_ps(tau, ratio));
+				_mm_storeu_ps(&vp.Phi[c][i], _mm_setzero_ps());
+				_mm_storeu_ps(&vp.throughput[c][i], _mm_setzero_ps());
+			}
+		}
+		for (; i < end; ++i)
+		{
+			s32 M = vp.M[i];
+			if (M > 0)
+			{
+				Real newN = vp.N[i] + alpha * M;
+				Real ratio = newN / (vp.N[i] + M);
+				for (s32 c = 0; c < 3; ++c)
+				{
+					vp.Tau[c][i] = (vp.Tau[c][i] + vp.throughput[c][i] * vp.Phi[c][i]) * ratio;
+					vp.Phi[c][i] = 0;
+				}
+				vp.N[i] = newN;
+				vp.radius[i] *= Math::Sqrt(ratio);
+				vp.M[i] = 0;
+			}
+			for (s32 c = 0; c < 3; ++c)
+				vp.throughput[c][i] = 0;
+		}
+	}
+
+	void SPPM::iterate()
+	{
+		typedef std::chrono::steady_clock Clock;
+		Clock::time_point begin = Clock::now();
+		resetTiles();
+		mContinueRendering = true;
+		startWorkerThreads();
+		while (traceNextTile(*mSampler))
+			fprintf(stderr, "\r[Tracer] Ray trace pass... %02d%%", int((Real)(mJobsDone) / mJobsCount * 100));
+		stopRaytracing();
+		Clock::time_point rayEnd = Clock::now();
+
+		s32 numPixels = mEndPos.x * mEndPos.y;
+		mHashGrids->rebuild(mPoints);
+		Clock::time_point gridEnd = Clock::now();
+
+		// Photons are traced in fixed chunks whose deposits are binned by pixel band. Each band
+		// then adds them up in chunk order, so the sums do not depend on the thread count.
+		const s32 chunkSize = 4096;
+		const s32 numBands = 64;
+		s32 bandPixels = (numPixels + numBands - 1) / numBands;
+		s32 numChunks = (photonsPerIt + chunkSize - 1) / chunkSize;
+		std::vector<std::vector<PhotonDeposit>> deposits((size_t)numChunks * numBands);
+		u64 firstIdx = (u64)curIteration * (u64)photonsPerIt;
+		Parrallel::parrallelFor(0, numChunks, [&](s32 start, s32 end) {
+			std::vector<PhotonDeposit> chunk;
+			for (s32 c = start; c < end; ++c)
+			{
+				chunk.clear();
+				s32 last = std::min(photonsPerIt, (c + 1) * chunkSize);
+				for (s32 i = c * chunkSize; i < last; ++i)
+					tracePhoton(firstIdx + i, chunk);
+				for (const PhotonDeposit& d : chunk)
+					deposits[(size_t)c * numBands + d.pixel / bandPixels].push_back(d);
+			}
+		});
+		Parrallel::parrallelFor(0, numBands, [&](s32 start, s32 end) {
+			VisiblePoints& vp = mPoints;
+			for (s32 b = start; b < end; ++b)
+			{
+				for (s32 c = 0; c < numChunks; ++c)
+				{
+					for (const PhotonDeposit& d : deposits[(size_t)c * numBands + b])
+					{
+						for (s32 k = 0; k < 3; ++k)
+							vp.Phi[k][d.pixel] += d.Phi[k];
+						++vp.M[d.pixel];
+					}
+				}
+			}
+		});
+		Clock::time_point photonEnd = Clock::now();
+
+		Parrallel::parrallelFor(0, numPixels, [&](s32 start, s32 end) {
+			updatePixel(start, end);
+		});
+
+		typedef std::chrono::duration<Real, std::milli> Ms;
+		Real photonMs = Ms(photonEnd - gridEnd).count();
+		fprintf(stderr, "\r[Tracer] Iteration %d: ray pass %.1f ms, grid %.1f ms, photon pass %.1f ms (%.0f photons/s)\n",
+			curIteration, Ms(rayEnd - begin).count(), Ms(gridEnd - rayEnd).count(), photonMs,
+			photonsPerIt / std::max(photonMs * Real(1e-3), Real(1e-6)));
+	}
+
+	void SPPM::startRaytracing()
+	{
+		if (mState != READY)
+			return;
+		s32 numPixels = mEndPos.x * mEndPos.y;
+		mPoints.resize(numPixels, radius);
+		if (!mHashGrids)
+			mHashGrids.reset(new SpatialHashGrids(numPixels));
+		curIteration = 0;
+		prepareRendering();
+	}
+
+	void SPPM::updateWorkerThread(s32 threadIdx)
+	{
+		// Seeded like mSampler, pixels look the same whichever thread traces them
+		std::unique_ptr<Sampler> tileSampler = mSampler->clone(0);
+		while (mContinueRendering)
+		{
+			if (!traceNextTile(*tileSampler))
+				break;
+		}
+	}
+
+	void SPPM::render(string filename)
+	{
+		startRaytracing();
+		for (; curIteration < numIteration; ++curIteration)
+			iterate();
+		fprintf(stderr, "\r[Tracer] Rendering Done!");
+		mState = DONE;
+		u8* frame = new u8[mEndPos.x * mEndPos.y * 3];
+		s32 offset = 0;
+		for (s32 y = mEndPos.y; y-- > 0; )
+		{
+			for (s32 x = 0; x < mEndPos.x; ++x)
+			{
+				s32 idx = x + y * mEndPos.x;
+				Spectrum c = getRadiance(idx, numIteration);
+				frame[offset++] = (u8)255 * Math::Pow(Math::Clamp(c.r, 0.0f, 1.0f), 0.6);
+				frame[offset++] = (u8)255 * Math::Pow(Math::Clamp(c.g, 0.0f, 1.0f), 0.6);
+				frame[offset++] = (u8)255 * Math::Pow(Math::Clamp(c.b, 0.0f, 1.0f), 0.6);
+			}
+		}
+		FILE* fp = fopen(filename.c_str(), "wb");
+		(void)fprintf(fp, "P6\n%d %d\n255\n", mEndPos.x, mEndPos.y);
+		fprintf(stderr, "\n[Tracer] Saving to file: %s... ", filename.c_str());
+		fwrite(frame, 1, mEndPos.x * mEndPos.y * 3, fp);
+		fprintf(stderr, "Done!\n");
+		fclose(fp);
+		delete[] frame;
+	}
+}
\ No newline at end of file
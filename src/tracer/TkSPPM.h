@@ -0,0 +1,82 @@
+#ifndef __Tk_SPPM_H_
+#define __Tk_SPPM_H_
+
+#include "TkRayTracer.h"
+#include "Intersection.hpp"
+#include "TkSpectrum.h"
+#include "Threads.h"
+
+namespace tk
+{
+	// What the photon gather needs of a visible point once a photon is in range
+	struct VisiblePointShading
+	{
+		const Material* material;
+		Vector3f wo, n;
+	};
+
+	// Per pixel visible points in SoA layout. Positions, radii, Phi and M are streamed by
+	// the photon gather and the per-iteration update, the other arrays are touched only
+	// when a photon is in range or once per iteration.
+	struct VisiblePoints
+	{
+		s32 size = 0;
+		std::vector<float> posX, posY, posZ;
+		// Current photon search radius
+		std::vector<float> radius;
+		// accumulation of fs * Phi_p (photon contribution) in this photon pass
+		std::vector<float> Phi[3];
+		// Number of photon hit this pixel in this photon pass
+		std::vector<s32> M;
+
+		// Photons that stays through the whole sppm iteration cycle
+		std::vector<float> N;
+		// Tau_i+1 = (Tau_i + Phi_i) * (Ri+1 / Ri)^2
+		std::vector<float> Tau[3];
+		// Camera path throughput at the visible point, zero for pixels without one
+		std::vector<float> throughput[3];
+		std::vector<VisiblePointShading> shading;
+		// Accumulated direct radiance contribution
+		std::vector<Spectrum> Ld;
+
+		void resize(s32 numPixels, Real initRadius);
+		bool valid(s32 i)const { return throughput[0][i] + throughput[1][i] + throughput[2][i] > 0; }
+	};
+
+	// Photon contribution to one visible point, collected per photon chunk
+	struct PhotonDeposit
+	{
+		s32 pixel;
+		float Phi[3];
+	};
+
+	class SpatialHashGrids;
+	// SPPM gathering photons at the visible points through a spatial hash grid,
+	// <tracer type="hashsppm"> with <gsize> photons per iteration
+	class SPPM : public RayTracer
+	{
+	private:
+		Real radius;
+		s32 numIteration;
+		s32 photonsPerIt;
+		s32 curIteration;
+		std::unique_ptr<SpatialHashGrids> mHashGrids;
+		VisiblePoints mPoints;
+
+		void visualize();
+		void rendering();
+		// Ray pass, grid construction, photon pass and radius update of one iteration
+		void iterate();
+		void tracePhoton(u64 haltonIdx, std::vector<PhotonDeposit>& deposits);
+		void traceTile(Point2i start, Point2i end, Sampler& sampler);
+		void updatePixel(s32 start, s32 end);
+		Spectrum getRadiance(s32 pixel, s32 iterations)const;
+	public:
+		SPPM(s32 spp, s32 maxDepth, Real russianRoulette, SPPMParam param);
+		~SPPM();
+		void startRaytracing();
+		void updateWorkerThread(s32 threadIdx);
+		void render(string filename);
+	};
+}
+#endif
\ No newline at end of file
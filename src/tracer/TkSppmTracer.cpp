@@ -5,16 +5,36 @@
 #include "Material.hpp"
 #include "Object.hpp"
 #include "TkLowdiscrepancy.h"
+#include "TkRng.h"
+#include "TkHash.h"
+#include "Triangle.hpp"
+#include "AreaLight.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 
 namespace tk
 {
-	SppmTracer::SppmTracer(s32 spp, s32 maxDepth, s32 numThreads, Real russianRoulette, SPPMParam param)
-		: RayTracer(spp, maxDepth, numThreads, russianRoulette),
+	SppmTracer::SppmTracer(s32 spp, s32 maxDepth, Real russianRoulette, SPPMParam param)
+		: RayTracer(spp, maxDepth, russianRoulette),
 		numRecurse(param.numRecurse),
-		radius2(param.radius2),
 		globalPhotonMap(param.globalSize, param.globalSample),
-		causticPhotonMap(param.causticSize, param.causticSample)
+		causticPhotonMap(param.causticSize, param.causticSample),
+		mGlobalMap(&globalPhotonMap), mCausticMap(&causticPhotonMap),
+		mNextGlobalMap(&globalPhotonMap), mNextCausticMap(&causticPhotonMap),
+		radius2(param.radius2),
+		mIrradianceStride(param.irradiance),
+		mImportance(param.importance != 0), mProjection(param.projection != 0),
+		mEmissionReady(false), mVoxelSize(0),
+		mPhotonCacheKey(0), mPhotonCacheLoaded(false)
 	{
+		if (param.pipeline)
+		{
+			mSpareGlobalMap.reset(new PhotonMap(param.globalSize, param.globalSample));
+			mSpareCausticMap.reset(new PhotonMap(param.causticSize, param.causticSample));
+			mNextGlobalMap = mSpareGlobalMap.get();
+			mNextCausticMap = mSpareCausticMap.get();
+		}
 		s32 x = 0, y = 0;
 		while (++x * ++y < numRecurse);
 		numRecurse = x * y;
@@ -35,9 +55,9 @@ namespace tk
 			prims[i]->drawOutline(Spectrum(0.8, 0.8, 1.0), 0.5);
 			//prims[i]->draw(Spectrum(0.8, 0.8, 1.0), 0.6);
 		if (shootCausticPhotons > 0)
-			causticPhotonMap.render_photons();
+			mCausticMap->render_photons();
 		else
-			globalPhotonMap.render_photons();
+			mGlobalMap->render_photons();
 	}
 
 	void SppmTracer::rendering()
@@ -45,39 +65,25 @@ namespace tk
 		switch (state)
 		{
 		case Generate:
-			if (storedGlobalPhotons < globalPhotonMap.size())
-				fprintf(stderr, "\r[Tracer] Generate global photon map... %02d%%", int((Real)(storedGlobalPhotons) / globalPhotonMap.size() * 100));
-			else if (storedCausticPhotons < causticPhotonMap.size())
-				fprintf(stderr, "\r[Tracer] Generate caustic photon map... %02d%%", int((Real)storedCausticPhotons / causticPhotonMap.size() * 100));
-			else
-			{
-				mNextStart = Point2i(0, 0);
-				mJobsDone = 0;
-				fprintf(stderr, "\r[Tracer] Generate caustic photon map... 100%%\n");
-				fprintf(stderr, "\r[Tracer] Shoot global photons %d\n", shootGlobalPhotons);
-				fprintf(stderr, "\r[Tracer] Shoot caustic photons %d\n", shootCausticPhotons);
-				globalPhotonMap.buildKdTree();
-				if (storedCausticPhotons > 0)
-					causticPhotonMap.buildKdTree();
-				state = Rendering;
-			}
+			preparePhotons(*mGlobalMap, *mCausticMap, curRecurse);
+			resetTiles();
+			mContinueRendering = true;
+			startWorkerThreads();
+			state = Rendering;
 			break;
 		case Rendering:
+			// Keeps the iteration going without pool workers
+			traceNextTile(*mSampler);
 			fprintf(stderr, "\r[Tracer] Iteration %d... %02d%%", curRecurse, int((Real)(mJobsDone) / mJobsCount * 100));
 			if (mJobsDone >= mJobsCount)
 			{
+				stopRaytracing();
 				fprintf(stderr, "\r[Tracer] Iteration %d... 100%%\n", curRecurse);
 				if (++curRecurse < numRecurse)
-				{
-					storedGlobalPhotons = 0;
-					storedCausticPhotons = 0;
-					globalPhotonMap.reset();
-					causticPhotonMap.reset();
 					state = Generate;
-				}
 				else
 				{
-					stopRaytracing();
+					closePhotonCache();
 					fprintf(stderr, "\r\n[Tracer] Rendering Done!");
 					mState = DONE;
 				}
@@ -85,7 +91,7 @@ namespace tk
 			for (s32 i = 0; i < mEndPos.x * mEndPos.y; ++i)
 			{
 				const SPPMPixel& p = pp[i];
-				Spectrum c = p.Ld / numRecurse + (storedCausticPhotons > 0 ?
+				Spectrum c = p.Ld / numRecurse + (mCausticMap->stored() > 0 ?
 					p.causticFlux / (Math::pi * p.causticRadius2 * shootCausticPhotons) : Spectrum::black) +
 					p.globalFlux / (Math::pi * p.globalRadius2 * shootGlobalPhotons);
 				u32 v = 0;
@@ -101,26 +107,102 @@ namespace tk
 			GL_UNSIGNED_BYTE, mFrameBuffer);
 	}
 
-	void SppmTracer::tracePhoton(u64 haltonIdx)
+	void EmissionGuide::init(const std::vector<float>& lightPdfs, s32 positionRes, s32 directionRes, std::vector<u8> mask)
 	{
+		s32 numLights = (s32)lightPdfs.size();
+		mLightPdfs = lightPdfs;
+		mPositionRes = positionRes;
+		mDirectionRes = directionRes;
+		mCellsPerLight = positionRes * positionRes * directionRes * directionRes;
+		mNumCells = numLights * mCellsPerLight;
+		mScore.assign(mNumCells, 0);
+		mPaths.assign(mNumCells, 0);
+		mMask = std::move(mask);
+		update();
+	}
+
+	s32 EmissionGuide::sample(Real u, Vector2f* uLight0, Vector2f* uLight1, s32* lightIdx, Real* pdf)const
+	{
+		float cellPdf;
+		s32 cell = mDistribution.sampleDiscrete(u, &cellPdf);
+		*lightIdx = cell / mCellsPerLight;
+		s32 c = cell % mCellsPerLight;
+		s32 dy = c % mDirectionRes, dx = (c / mDirectionRes) % mDirectionRes;
+		s32 py = (c / (mDirectionRes * mDirectionRes)) % mPositionRes;
+		s32 px = c / (mDirectionRes * mDirectionRes * mPositionRes);
+		*uLight0 = Vector2f((px + uLight0->x) / mPositionRes, (py + uLight0->y) / mPositionRes);
+		*uLight1 = Vector2f((dx + uLight1->x) / mDirectionRes, (dy + uLight1->y) / mDirectionRes);
+		*pdf = cellPdf * mCellsPerLight;
+		return cell;
+	}
+
+	void EmissionGuide::update()
+	{
+		// Cells without paths yet get the average, a quarter of it is added everywhere
+		Real sum = 0, count = 0;
+		for (s32 i = 0; i < mNumCells; ++i)
+		{
+			if (mPaths[i] > 0)
+			{
+				sum += mScore[i] / mPaths[i];
+				count += 1;
+			}
+		}
+		Real mean = count > 0 ? sum / count : 0;
+		if (mean <= 0)
+			mean = 1;
+		std::vector<float> f(mNumCells);
+		for (s32 i = 0; i < mNumCells; ++i)
+		{
+			// Unmarked cells keep a small floor so emission stays unbiased where the mask errs
+			if (!mMask.empty() && !mMask[i])
+				f[i] = ((mPaths[i] > 0 ? mScore[i] / mPaths[i] : 0) + 0.01f * mean) * mLightPdfs[i / mCellsPerLight];
+			else
+				f[i] = ((mPaths[i] > 0 ? mScore[i] / mPaths[i] : mean) + 0.25f * mean) * mLightPdfs[i / mCellsPerLight];
+		}
+		mDistribution = Distribution1D(f.data(), mNumCells);
+	}
+
+	s32 SppmTracer::emitPhoton(u64 haltonIdx, const EmissionGuide& guide, Ray* r, Spectrum* power, bool* valid)const
+	{
+		*valid = false;
 		s32 haltonDim = 0;
 		const std::vector<std::shared_ptr<AreaLight>>& lights = mScene->get_lights();
 		int numLights = lights.size();
-		if (numLights == 0) return;
-		int lightIdx = std::min<int>(RadicalInverse(haltonDim++, haltonIdx) * numLights, numLights - 1);
-		float pdf = 1.0f / numLights;
-		float pos_pdf, dir_pdf;
-		Ray r;
-		Vector3f normal;
+		if (numLights == 0) return -1;
+		Real u = RadicalInverse(haltonDim++, haltonIdx);
 		Vector2f uLight0(RadicalInverse(haltonDim, haltonIdx), RadicalInverse(haltonDim + 1, haltonIdx));
 		Vector2f uLight1(RadicalInverse(haltonDim + 2, haltonIdx), RadicalInverse(haltonDim + 3, haltonIdx));
-		haltonDim += 4;
-		Spectrum power = lights[lightIdx]->sample_Le(uLight0, uLight1, 0, &r, &normal, &pos_pdf, &dir_pdf);
-
+		s32 cell = -1, lightIdx;
+		float pdf;
+		if (guide.active())
+			cell = guide.sample(u, &uLight0, &uLight1, &lightIdx, &pdf);
+		else
+		{
+			lightIdx = mScene->sampleLight(u, &pdf);
+		}
+		float pos_pdf, dir_pdf;
+		Vector3f normal;
+		*power = lights[lightIdx]->sample_Le(uLight0, uLight1, 0, r, &normal, &pos_pdf, &dir_pdf);
 		if (pos_pdf == 0 || dir_pdf == 0)
-			return;
-		power = power * AbsDot(r.direction, normal) / (pos_pdf * dir_pdf * pdf);
-		bool exit = false;
+			return cell;
+		*power = *power * AbsDot(r->direction, normal) / (pos_pdf * dir_pdf * pdf);
+		*valid = true;
+		return cell;
+	}
+
+	s32 SppmTracer::tracePhoton(u64 haltonIdx, std::vector<Photon>& photons)
+	{
+		// The light sample takes the first five Halton dimensions
+		s32 haltonDim = 5;
+		Ray r;
+		Spectrum power;
+		bool valid;
+		s32 cell = emitPhoton(haltonIdx, mGlobalGuide, &r, &power, &valid);
+		if (!valid)
+			return cell;
+		// Seeded by the path index so that the path does not depend on the thread tracing it
+		RNG rng(haltonIdx);
 		for (int i = 0; i < mMaxDepth; ++i)
 		{
 			Intersection isect;
@@ -131,17 +213,9 @@ namespace tk
 			m->setTransportMode(Importance);
 			bool isDiffuse = m->getType() == DIFFUSE;
 			if (isDiffuse)
-			{
-				int theta = std::min(int(255 * acos(wo.z) * Math::inv_pi), 255);
-				int phi = 255 * atan2(wo.y, wo.x) / (2 * Math::pi);
-				if (phi < 0)
-					phi += 255;
-				mutex1.lock();
-				exit = !globalPhotonMap.storePhoton(isect.p, power, theta, std::min(phi, 255), storedGlobalPhotons);
-				mutex1.unlock();
-			}
+				photons.push_back(Photon(isect.p, power, wo, isect.n));
 
-			if (exit || get_random_float() > mRussianRoulette)
+			if (rng.uniformFloat() > mRussianRoulette)
 				break;
 
 			Vector3f wi;
@@ -154,27 +228,19 @@ namespace tk
 				(pdf * mRussianRoulette);
 			r = isect.spawnRay(wi);
 		}
+		return cell;
 	}
 
-	void SppmTracer::traceCausticPhoton(u64 haltonIdx)
+	s32 SppmTracer::traceCausticPhoton(u64 haltonIdx, std::vector<Photon>& photons)
 	{
-		s32 haltonDim = 0;
-		const std::vector<std::shared_ptr<AreaLight>>& lights = mScene->get_lights();
-		int numLights = lights.size();
-		if (numLights == 0) return;
-		int lightIdx = std::min<int>(RadicalInverse(haltonDim++, haltonIdx) * numLights, numLights - 1);
-		float pdf = 1.0f / numLights;
-		float pos_pdf, dir_pdf;
+		s32 haltonDim = 5;
 		Ray r;
-		Vector3f normal;
-		Vector2f uLight0(RadicalInverse(haltonDim, haltonIdx), RadicalInverse(haltonDim + 1, haltonIdx));
-		Vector2f uLight1(RadicalInverse(haltonDim + 2, haltonIdx), RadicalInverse(haltonDim + 3, haltonIdx));
-		haltonDim += 4;
-		Spectrum power = lights[lightIdx]->sample_Le(uLight0, uLight1, 0, &r, &normal, &pos_pdf, &dir_pdf);
-
-		if (pos_pdf == 0 || dir_pdf == 0)
-			return;
-		power = power * AbsDot(r.direction, normal) / (pos_pdf * dir_pdf * pdf);
+		Spectrum power;
+		bool valid;
+		s32 cell = emitPhoton(haltonIdx, mCausticGuide, &r, &power, &valid);
+		if (!valid)
+			return cell;
+		RNG rng(haltonIdx);
 		bool hasGlossy = false;
 		for (int i = 0; i < 64; ++i)
 		{
@@ -189,19 +255,11 @@ namespace tk
 			if (isDiffuse)
 			{
 				if (hasGlossy)
-				{
-					int theta = std::min(int(255 * acos(wo.z) * Math::inv_pi), 255);
-					int phi = 255 * atan2(wo.y, wo.x) / (2 * Math::pi);
-					if (phi < 0)
-						phi += 255;
-					mutex1.lock();
-					causticPhotonMap.storePhoton(isect.p, power, theta, std::min(phi, 255), storedCausticPhotons);
-					mutex1.unlock();
-				}				
+					photons.push_back(Photon(isect.p, power, wo, isect.n));
 				break;
 			}
 
-			if (get_random_float() > mRussianRoulette)
+			if (rng.uniformFloat() > mRussianRoulette)
 				break;
 
 			Vector3f wi;
@@ -214,6 +272,455 @@ namespace tk
 				(pdf * mRussianRoulette);
 			r = isect.spawnRay(wi);
 		}
+		return cell;
+	}
+
+	bool SppmTracer::traceToDiffuse(Ray r, RNG& rng, Intersection* isect)const
+	{
+		for (int i = 0; i < mMaxDepth; ++i)
+		{
+			if (!mScene->intersect(r, isect))
+				return false;
+			const Material* m = isect->obj->getMaterial();
+			if (m->getType() == DIFFUSE)
+				return true;
+			m->setTransportMode(Radiance);
+			Vector3f wi;
+			float pdf = 0;
+			Vector2f u(rng.uniformFloat(), rng.uniformFloat());
+			Spectrum f = m->sample_f(-r.direction, &wi, isect->n, u, &pdf);
+			if (pdf == 0 || f == Spectrum::black)
+				return false;
+			r = isect->spawnRay(wi);
+		}
+		return false;
+	}
+
+	size_t SppmTracer::voxelSlot(const std::vector<float>& importons, s32 x, s32 y, s32 z)const
+	{
+		return Hash(x, y, z) & (importons.size() - 1);
+	}
+
+	float SppmTracer::importance(const std::vector<float>& importons, const Vector3f& p)const
+	{
+		// Voxels are a gather radius wide, the neighbours cover every point in reach
+		s32 vx = (s32)std::floor(p.x / mVoxelSize), vy = (s32)std::floor(p.y / mVoxelSize),
+			vz = (s32)std::floor(p.z / mVoxelSize);
+		float sum = 0;
+		for (s32 dz = -1; dz <= 1; ++dz)
+			for (s32 dy = -1; dy <= 1; ++dy)
+				for (s32 dx = -1; dx <= 1; ++dx)
+					sum += importons[voxelSlot(importons, vx + dx, vy + dy, vz + dz)];
+		return sum;
+	}
+
+	void SppmTracer::traceImportons()
+	{
+		typedef std::chrono::steady_clock Clock;
+		Clock::time_point begin = Clock::now();
+		mVoxelSize = std::sqrt(radius2);
+		const s32 bounces = 4;
+		std::vector<std::vector<Vector3f>> direct(mEndPos.y), indirect(mEndPos.y);
+		Parrallel::parrallelFor(0, mEndPos.y, [&](s32 start, s32 end) {
+			for (s32 y = start; y < end; ++y)
+			{
+				for (s32 x = 0; x < mEndPos.x; ++x)
+				{
+					RNG rng(u64(y) * mEndPos.x + x);
+					Ray r;
+					Vector2f cameraSample(x + rng.uniformFloat(), y + rng.uniformFloat());
+					mCamera->generateRay(cameraSample, Vector2f(rng.uniformFloat(), rng.uniformFloat()), &r);
+					Intersection isect;
+					if (!traceToDiffuse(r, rng, &isect))
+						continue;
+					direct[y].push_back(isect.p);
+					const Material* m = isect.obj->getMaterial();
+					m->setTransportMode(Radiance);
+					for (s32 i = 0; i < bounces; ++i)
+					{
+						Vector3f wi;
+						float pdf = 0;
+						Vector2f u(rng.uniformFloat(), rng.uniformFloat());
+						Spectrum f = m->sample_f(isect.wo, &wi, isect.n, u, &pdf);
+						Intersection second;
+						if (pdf > 0 && f != Spectrum::black && traceToDiffuse(isect.spawnRay(wi), rng, &second))
+							indirect[y].push_back(second.p);
+					}
+				}
+			}
+		});
+		// Each pixel weighs 1 in both maps, the importons are counted in row order
+		auto splat = [this](std::vector<float>& importons, const std::vector<std::vector<Vector3f>>& rows, float weight) {
+			size_t numPoints = 0;
+			for (const std::vector<Vector3f>& row : rows)
+				numPoints += row.size();
+			size_t slots = 1;
+			while (slots < numPoints * 4)
+				slots <<= 1;
+			importons.assign(slots, 0.0f);
+			for (const std::vector<Vector3f>& row : rows)
+				for (const Vector3f& p : row)
+					importons[voxelSlot(importons, (s32)std::floor(p.x / mVoxelSize),
+						(s32)std::floor(p.y / mVoxelSize), (s32)std::floor(p.z / mVoxelSize))] += weight;
+			return numPoints;
+		};
+		size_t numDirect = splat(mCausticImportons, direct, 1.0f);
+		size_t numIndirect = splat(mGlobalImportons, indirect, 1.0f / bounces);
+		fprintf(stderr, "\r[Tracer] Importons traced: %d direct, %d indirect in %.1f ms\n", (s32)numDirect,
+			(s32)numIndirect, std::chrono::duration<Real, std::milli>(Clock::now() - begin).count());
+	}
+
+	std::vector<u8> SppmTracer::buildProjectionMaps(s32 positionRes, s32 directionRes)const
+	{
+		struct Sphere
+		{
+			Vector3f center;
+			Real radius;
+		};
+		std::vector<Sphere> spheres;
+		for (const auto& obj : mScene->get_objects())
+		{
+			if (!(obj->getMaterial()->getType() & (MIRROR | GLASS)))
+				continue;
+			Bounds3 b = obj->getBounds();
+			spheres.push_back(Sphere{ b.Centroid(), b.Diagonal().norm() * Real(0.5) });
+		}
+		const std::vector<std::shared_ptr<AreaLight>>& lights = mScene->get_lights();
+		s32 directionCells = directionRes * directionRes;
+		s32 cellsPerLight = positionRes * positionRes * directionCells;
+		std::vector<u8> mask(lights.size() * cellsPerLight, 0);
+		if (spheres.empty())
+			return mask;
+		// Part of the emitting surface a position cell maps to: bounds on one triangle and a
+		// light sample landing there, which gives the frame its directions are built in
+		struct Piece
+		{
+			Bounds3 bounds;
+			Vector2f u0;
+		};
+		const Real e = Math::one_minus_epsilon;
+		const Real grid[3] = { 0, 0.5f, e };
+		s32 numPositionCells = (s32)lights.size() * positionRes * positionRes;
+		Parrallel::parrallelFor(0, numPositionCells, [&](s32 start, s32 end) {
+			std::vector<Piece> pieces;
+			for (s32 p = start; p < end; ++p)
+			{
+				const AreaLight* light = lights[p / (positionRes * positionRes)].get();
+				const Shape* shape = light->getShape();
+				s32 px = (p / positionRes) % positionRes, py = p % positionRes;
+				Real lo = (Real)px / positionRes, hi = (Real)(px + 1) / positionRes;
+				Real v0 = (Real)py / positionRes, v1 = (Real)(py + 1) / positionRes;
+				pieces.clear();
+				// Triangle sampling is bilinear in sqrt(u.x) and u.y, the image of the sample
+				// rectangle [x0, x1] x [v0, v1] lies in the hull of its corners
+				auto addPiece = [&](const Shape* tri, Real x0, Real x1, const Vector2f& u0) {
+					Bounds3 bounds;
+					for (s32 i = 0; i < 4; ++i)
+					{
+						float pdf;
+						Vector2f u(std::min(i & 1 ? x1 : x0, e), std::min(i & 2 ? v1 : v0, e));
+						bounds = Union(bounds, tri->Sample(u, &pdf).p);
+					}
+					pieces.push_back(Piece{ bounds, u0 });
+				};
+				// The first light sample picks a mesh triangle through the area CDF, so the cell
+				// covers part of every triangle whose CDF range it overlaps
+				if (const MeshTriangle* mesh = dynamic_cast<const MeshTriangle*>(shape))
+				{
+					const std::vector<float>& cdf = mesh->distribution.cdf;
+					for (size_t i = 0; i + 1 < cdf.size(); ++i)
+					{
+						Real a = std::max<Real>(cdf[i], lo), b = std::min<Real>(cdf[i + 1], hi);
+						if (a < b)
+							addPiece(mesh->triangles[i].getShape(), (a - cdf[i]) / (cdf[i + 1] - cdf[i]),
+								(b - cdf[i]) / (cdf[i + 1] - cdf[i]), Vector2f((a + b) * 0.5f, (v0 + v1) * 0.5f));
+					}
+				}
+				else if (dynamic_cast<const Triangle*>(shape))
+					addPiece(shape, lo, hi, Vector2f((lo + hi) * 0.5f, (v0 + v1) * 0.5f));
+				else
+				{
+					// Other shapes turn their frame across the cell, keep every direction
+					std::fill_n(mask.begin() + (size_t)p * directionCells, directionCells, 1);
+					continue;
+				}
+
+				for (s32 d = 0; d < directionCells; ++d)
+				{
+					s32 dx = d / directionRes, dy = d % directionRes;
+					bool hit = false;
+					for (size_t k = 0; k < pieces.size() && !hit; ++k)
+					{
+						// The direction map is smooth within a cell: take the cone around the mean
+						// of a 3x3 probe grid through the farthest probe, widened by half
+						Ray rays[9];
+						s32 numRays = 0;
+						for (s32 i = 0; i < 9; ++i)
+						{
+							Vector2f u1((dx + grid[i / 3]) / directionRes, (dy + grid[i % 3]) / directionRes);
+							Vector3f n;
+							Real pdfPos, pdfDir;
+							light->sample_Le(pieces[k].u0, u1, 0, &rays[numRays], &n, &pdfPos, &pdfDir);
+							if (pdfPos > 0 && pdfDir > 0)
+								++numRays;
+						}
+						if (numRays == 0)
+							continue;
+						Vector3f axis(0, 0, 0);
+						for (s32 i = 0; i < numRays; ++i)
+							axis = axis + rays[i].direction;
+						axis = normalize(axis);
+						Real theta = 0;
+						for (s32 i = 0; i < numRays; ++i)
+							theta = std::max(theta, std::acos(Math::Clamp(dotProduct(axis, rays[i].direction), -1.0f, 1.0f)));
+						theta = std::min(theta * 1.5f, Math::pi);
+						// A ray leaving within posSpread of origin and theta of axis is, after s, within
+						// posSpread + s * chord of the axis
+						Real chord = 2 * std::sin(theta * 0.5f);
+						Vector3f origin = pieces[k].bounds.Centroid();
+						Real posSpread = pieces[k].bounds.Diagonal().norm() * 0.5f;
+						for (const Sphere& s : spheres)
+						{
+							Vector3f oc = s.center - origin;
+							Real t = std::max(Real(0), dotProduct(oc, axis));
+							Real dist = (oc - axis * t).norm();
+							if (dist <= s.radius + posSpread + (oc.norm() + posSpread + s.radius) * chord)
+							{
+								hit = true;
+								break;
+							}
+						}
+					}
+					mask[p * directionCells + d] = hit;
+				}
+			}
+		});
+		return mask;
+	}
+
+	void SppmTracer::initEmission()
+	{
+		typedef std::chrono::steady_clock Clock;
+		mEmissionReady = true;
+		const std::vector<std::shared_ptr<AreaLight>>& lights = mScene->get_lights();
+		if (lights.empty())
+			return;
+		std::vector<float> lightPdfs(lights.size());
+		for (size_t i = 0; i < lights.size(); ++i)
+			lightPdfs[i] = mScene->lightPdf(lights[i].get());
+		if (mImportance)
+		{
+			traceImportons();
+			mGlobalGuide.init(lightPdfs);
+			mCausticGuide.init(lightPdfs);
+		}
+		if (mProjection)
+		{
+			Clock::time_point begin = Clock::now();
+			const s32 positionRes = 8, directionRes = 32;
+			std::vector<u8> mask = buildProjectionMaps(positionRes, directionRes);
+			s32 marked = (s32)std::count(mask.begin(), mask.end(), 1);
+			fprintf(stderr, "\r[Tracer] Projection maps: %.1f%% of the light cells reach specular objects, built in %.1f ms\n",
+				100.0f * marked / mask.size(), std::chrono::duration<Real, std::milli>(Clock::now() - begin).count());
+			// Without specular objects the caustic pass gives up on its own
+			if (marked > 0)
+				mCausticGuide.init(lightPdfs, positionRes, directionRes, std::move(mask));
+		}
+	}
+
+	void SppmTracer::generatePhotons(PhotonMap& map, s32* shot, u64 firstIdx, bool caustic)
+	{
+		typedef std::chrono::steady_clock Clock;
+		const s32 chunkSize = 256;
+		const s32 maxChunks = 4096;
+		Clock::time_point begin = Clock::now();
+		EmissionGuide& guide = caustic ? mCausticGuide : mGlobalGuide;
+		const bool learn = mImportance && guide.active();
+		s32 stored = 0, paths = 0;
+		const std::vector<float>& importons = caustic ? mCausticImportons : mGlobalImportons;
+		s32 usefulPhotons = 0;
+		bool full = map.size() == 0;
+		while (!full)
+		{
+			// Size the round from the photons per path seen so far
+			s64 remaining = map.size() - stored;
+			s64 estimate = stored > 0 ? remaining * paths / stored + 1 : remaining;
+			s32 numChunks = (s32)std::min<s64>((estimate + chunkSize - 1) / chunkSize, maxChunks);
+			std::vector<std::vector<Photon>> photons(numChunks);
+			std::vector<std::vector<s32>> pathEnds(numChunks);
+			// Emission cell of each path, the importance its photons landed in and
+			// how many of them can be gathered at all
+			std::vector<std::vector<s32>> pathCells(numChunks);
+			std::vector<std::vector<float>> pathScores(numChunks);
+			std::vector<std::vector<s32>> pathUseful(numChunks);
+			u64 roundIdx = firstIdx + paths;
+			Parrallel::parrallelFor(0, numChunks, [&](s32 start, s32 end) {
+				for (s32 c = start; c < end; ++c)
+				{
+					pathEnds[c].resize(chunkSize);
+					if (learn)
+					{
+						pathCells[c].resize(chunkSize);
+						pathScores[c].resize(chunkSize);
+						pathUseful[c].resize(chunkSize);
+					}
+					for (s32 i = 0; i < chunkSize; ++i)
+					{
+						u64 haltonIdx = roundIdx + (u64)c * chunkSize + i;
+						s32 first = (s32)photons[c].size();
+						s32 cell;
+						if (caustic)
+							cell = traceCausticPhoton(haltonIdx, photons[c]);
+						else
+							cell = tracePhoton(haltonIdx, photons[c]);
+						pathEnds[c][i] = (s32)photons[c].size();
+						if (learn)
+						{
+							float score = 0;
+							s32 useful = 0;
+							for (s32 k = first; k < pathEnds[c][i]; ++k)
+							{
+								float w = importance(importons, photons[c][k].pos);
+								score += w;
+								useful += w > 0;
+							}
+							pathCells[c][i] = cell;
+							pathScores[c][i] = score;
+							pathUseful[c][i] = useful;
+						}
+					}
+				}
+			});
+
+			// Whole paths are kept in index order up to the first one that does not fit
+			std::vector<s32> offsets(numChunks, 0), counts(numChunks, 0);
+			for (s32 c = 0; c < numChunks && !full; ++c)
+			{
+				s32 kept = chunkSize;
+				if (stored + (s32)photons[c].size() > map.size())
+				{
+					kept = s32(std::upper_bound(pathEnds[c].begin(), pathEnds[c].end(), map.size() - stored) - pathEnds[c].begin());
+					full = true;
+				}
+				offsets[c] = stored;
+				counts[c] = kept > 0 ? pathEnds[c][kept - 1] : 0;
+				stored += counts[c];
+				paths += kept;
+				// Recorded in path order, the guide stays independent of the thread count
+				if (learn)
+				{
+					for (s32 i = 0; i < kept; ++i)
+					{
+						if (pathCells[c][i] >= 0)
+							guide.record(pathCells[c][i], pathScores[c][i]);
+						usefulPhotons += pathUseful[c][i];
+					}
+				}
+			}
+			Parrallel::parrallelFor(0, numChunks, [&](s32 start, s32 end) {
+				for (s32 c = start; c < end; ++c)
+					map.storePhotons(offsets[c], photons[c].data(), counts[c]);
+			});
+			// A scene without specular surfaces never stores caustic photons
+			if (stored == 0 && paths >= 16 * map.size())
+				break;
+		}
+		map.setStored(stored);
+		*shot += paths;
+
+		Real elapsed = std::chrono::duration<Real>(Clock::now() - begin).count();
+		fprintf(stderr, "\r[Tracer] %s photons: %d stored from %d paths, %.0f paths/s, %.0f photons/s\n",
+			caustic ? "Caustic" : "Global", stored, paths, paths / std::max(elapsed, Real(1e-6)),
+			stored / std::max(elapsed, Real(1e-6)));
+		if (learn)
+		{
+			fprintf(stderr, "\r[Tracer] %.1f%% of the %s photons near gather points\n",
+				100.0f * usefulPhotons / std::max(stored, 1), caustic ? "caustic" : "global");
+			guide.update();
+		}
+	}
+
+	void SppmTracer::photonPass(PhotonMap& globalMap, PhotonMap& causticMap)
+	{
+		if (!mEmissionReady)
+			initEmission();
+		globalMap.reset();
+		causticMap.reset();
+		generatePhotons(globalMap, &shootGlobalPhotons, shootGlobalPhotons, false);
+		// Caustic paths continue the Halton sequence after the global ones
+		generatePhotons(causticMap, &shootCausticPhotons, (u64)shootGlobalPhotons + shootCausticPhotons, true);
+		typedef std::chrono::steady_clock Clock;
+		Clock::time_point begin = Clock::now();
+		globalMap.buildKdTree();
+		if (causticMap.stored() > 0)
+			causticMap.buildKdTree();
+		fprintf(stderr, "\r[Tracer] Photon kd-trees built in %.1f ms\n",
+			std::chrono::duration<Real, std::milli>(Clock::now() - begin).count());
+	}
+
+	void SppmTracer::preparePhotons(PhotonMap& globalMap, PhotonMap& causticMap, s32 iteration)
+	{
+		if (!mPhotonCacheLoaded || !mPhotonCache->attach(iteration, globalMap, causticMap,
+			&shootGlobalPhotons, &shootCausticPhotons))
+		{
+			photonPass(globalMap, causticMap);
+			// Passes run one after another even when pipelined, so iterations arrive in order
+			if (mPhotonCache && mPhotonCache->writing())
+				mPhotonCache->append(globalMap, causticMap, shootGlobalPhotons, shootCausticPhotons);
+		}
+		if (mIrradianceStride > 0)
+		{
+			// The global map is only gathered after a diffuse bounce, where the
+			// blur of the precomputed irradiance doesn't show
+			typedef std::chrono::steady_clock Clock;
+			Clock::time_point begin = Clock::now();
+			s32 count = globalMap.precomputeIrradiance(mIrradianceStride, radius2);
+			fprintf(stderr, "\r[Tracer] Irradiance precomputed at %d photons in %.1f ms\n", count,
+				std::chrono::duration<Real, std::milli>(Clock::now() - begin).count());
+		}
+	}
+
+	void SppmTracer::setPhotonCache(const string& filename, u64 sceneHash)
+	{
+		mPhotonCacheFile = filename;
+		// Everything the photon paths depend on besides the scene
+		const u64 prime = 0x100000001b3ULL;
+		u64 key = sceneHash;
+		u32 roulette;
+		memcpy(&roulette, &mRussianRoulette, sizeof(roulette));
+		const s64 params[] = { numRecurse, globalPhotonMap.size(), causticPhotonMap.size(),
+			mMaxDepth, roulette, mImportance, mProjection };
+		for (s64 v : params)
+			key = (key ^ (u64)v) * prime;
+		mPhotonCacheKey = key;
+	}
+
+	void SppmTracer::openPhotonCache()
+	{
+		mPhotonCacheLoaded = false;
+		if (mPhotonCacheFile.empty())
+			return;
+		mPhotonCache.reset(new PhotonMapCache());
+		// Importons are traced from the camera, steered maps only fit the view they were made for
+		u64 key = mImportance ? Hash(mPhotonCacheKey, mCamera->hash()) : mPhotonCacheKey;
+		if (mPhotonCache->open(mPhotonCacheFile, key, numRecurse))
+		{
+			mPhotonCacheLoaded = true;
+			fprintf(stderr, "\r[Tracer] Photon maps loaded from cache %s\n", mPhotonCacheFile.c_str());
+		}
+		else if (!mPhotonCache->create(mPhotonCacheFile, key))
+			fprintf(stderr, "\r[Tracer] Can't create photon cache %s\n", mPhotonCacheFile.c_str());
+	}
+
+	void SppmTracer::closePhotonCache()
+	{
+		if (mPhotonCache && mPhotonCache->writing())
+		{
+			if (mPhotonCache->finish())
+				fprintf(stderr, "\r[Tracer] Photon maps written to cache %s\n", mPhotonCacheFile.c_str());
+			else
+				fprintf(stderr, "\r[Tracer] Failed to write photon cache %s\n", mPhotonCacheFile.c_str());
+		}
 	}
 
 	/*void SppmTracer::traceTile(Point2i start, Point2i end, Sampler& sampler)
@@ -314,16 +821,16 @@ namespace tk
 					if (hasGlossy)
 						p.Ld += coef * isect.Le(wo);
 					if (hasGlossy || !isDiffuse)
-						p.Ld += coef * mScene->uniformSampleOneLight(isect, sampler);
+						p.Ld += coef * mScene->sampleOneLight(isect, sampler);
 					if (isDiffuse)
 					{
 						float radius2;
 						int numPhotons;
 						Spectrum Lindir;
-						if (hasGlossy && storedCausticPhotons > 0)
+						if (hasGlossy && mCausticMap->stored() > 0)
 						{
 							radius2 = p.causticRadius2;
-							Lindir = (coef * causticPhotonMap.radiance_estimate(isect, radius2, numPhotons));
+							Lindir = (coef * mCausticMap->radiance_estimate(isect, radius2, numPhotons));
 							if (p.causticPhotons == 0)
 							{
 								p.causticRadius2 = radius2;
@@ -342,7 +849,7 @@ namespace tk
 						if (!hasGlossy)
 						{
 							radius2 = p.globalRadius2;
-							Lindir = (coef * globalPhotonMap.radiance_estimate(isect, radius2, numPhotons));
+							Lindir = (coef * mGlobalMap->radiance_estimate(isect, radius2, numPhotons));
 							if (p.globalPhotons == 0)
 							{
 								p.globalRadius2 = radius2;
@@ -376,9 +883,9 @@ namespace tk
 	void SppmTracer::startVisualizing()
 	{
 		if (shootCausticPhotons > 0)
-			causticPhotonMap.update_photons();
+			mCausticMap->update_photons();
 		else
-			globalPhotonMap.update_photons();
+			mGlobalMap->update_photons();
 		RayTracer::startVisualizing();
 	}
 
@@ -386,160 +893,94 @@ namespace tk
 	{	
 		shootGlobalPhotons = 0;
 		shootCausticPhotons = 0;
-		storedGlobalPhotons = 0;
-		storedCausticPhotons = 0;
 		curRecurse = 0;
-		globalPhotonMap.reset();
-		causticPhotonMap.reset();
+		// The camera may have moved, importons are traced again by the first photon pass
+		mEmissionReady = false;
+		mGlobalImportons.clear();
+		mCausticImportons.clear();
+		mGlobalGuide = EmissionGuide();
+		mCausticGuide = EmissionGuide();
+		mGlobalMap->reset();
+		mCausticMap->reset();
 		pp.clear();
 		pp.resize(mEndPos.x * mEndPos.y, SPPMPixel(radius2));
+		if (mState != READY)
+			return;
+		openPhotonCache();
 		state = Generate;
-		RayTracer::startRaytracing();
+		prepareRendering();
 	}
 
-	unsigned long SppmTracer::updateWorkerThread(ThreadHandle* handle)
+	void SppmTracer::updateWorkerThread(s32 threadIdx)
 	{
-		s32 idx = handle->getThreadIdx();
-		std::unique_ptr<Sampler> tileSampler = mSampler->clone(idx);
+		// Seeded like mSampler, pixels look the same whichever thread traces them
+		std::unique_ptr<Sampler> tileSampler = mSampler->clone(0);
 		while (mContinueRendering)
 		{
-			switch (state)
-			{
-			case Generate:
-			{
-				s32 haltonIdx = shootGlobalPhotons;
-				while (storedGlobalPhotons < globalPhotonMap.size())
-				{
-					tracePhoton(haltonIdx);
-					haltonIdx = ++shootGlobalPhotons;
-				}
-				haltonIdx = shootCausticPhotons;
-				while (storedCausticPhotons < causticPhotonMap.size())
-				{
-					traceCausticPhoton(haltonIdx + shootGlobalPhotons);
-					haltonIdx = ++shootCausticPhotons;
-				}
-			}
+			if (!traceNextTile(*tileSampler))
 				break;
-			case Rendering:
-			{
-				mutex.lock();
-				Point2i start = mNextStart;
-				Point2i end = mNextStart + Point2i(mTileSize, mTileSize);
-				mNextStart.x += mTileSize;
-				if (mNextStart.x >= mEndPos.x)
-				{
-					mNextStart.x = 0;
-					end.x = mEndPos.x;
-					mNextStart.y += mTileSize;
-				}
-				mutex.unlock();
-				end.y = std::min(end.y, mEndPos.y);
-				traceTile(start, end, *tileSampler);
-				++mJobsDone;
-			}
-				break;
-			}					
 		}
-		return 0;
 	}
 
 	void SppmTracer::render(string filename)
 	{
+		typedef std::chrono::steady_clock Clock;
 		startRaytracing();
-		while (1)
+		bool pipelined = mNextGlobalMap != mGlobalMap;
+		preparePhotons(*mGlobalMap, *mCausticMap, curRecurse);
+		for (; curRecurse < numRecurse; ++curRecurse)
 		{
-			switch (state)
+			// The next photon pass runs as a pool task next to the tile workers,
+			// threads that run out of tiles help with its parallel loops
+			std::shared_ptr<ParallelJob> nextPass;
+			if (pipelined && curRecurse + 1 < numRecurse)
+				nextPass = Parrallel::parrallelAsync(1, [this](s32) {
+					preparePhotons(*mNextGlobalMap, *mNextCausticMap, curRecurse + 1);
+				});
+			resetTiles();
+			mContinueRendering = true;
+			startWorkerThreads();
+			while (traceNextTile(*mSampler))
+				fprintf(stderr, "\r[Tracer] Iteration %d... %02d%%", curRecurse, int((Real)(mJobsDone) / mJobsCount * 100));
+			stopRaytracing();
+			fprintf(stderr, "\r[Tracer] Iteration %d... 100%%\n", curRecurse);
+			if (nextPass)
 			{
-			case Generate:
-			{
-				s32 haltonIdx = shootGlobalPhotons;
-				while (storedGlobalPhotons < globalPhotonMap.size())
-				{
-					tracePhoton(haltonIdx);
-					haltonIdx += ++shootGlobalPhotons;
-					fprintf(stderr, "\r[Tracer] Generate global photon map... %02d%%", int((Real)(storedGlobalPhotons) / globalPhotonMap.size() * 100));
-				}
-				fprintf(stderr, "\r[Tracer] Generate global photon map... 100%%\n");
-				haltonIdx = shootCausticPhotons;
-				while (storedCausticPhotons < causticPhotonMap.size())
-				{
-					traceCausticPhoton(haltonIdx + shootGlobalPhotons);
-					haltonIdx = ++shootCausticPhotons;
-					fprintf(stderr, "\r[Tracer] Generate caustic photon map... %02d%%", int((Real)storedCausticPhotons / causticPhotonMap.size() * 100));
-				}
-				fprintf(stderr, "\r[Tracer] Generate caustic photon map... 100%%\n");
-				mNextStart = Point2i(0, 0);
-				mJobsDone = 0;	
-				fprintf(stderr, "\r[Tracer] Shoot global photons %d\n", shootGlobalPhotons);
-				fprintf(stderr, "\r[Tracer] Shoot caustic photons %d\n", shootCausticPhotons);
-				globalPhotonMap.buildKdTree();
-				if (storedCausticPhotons > 0)
-					causticPhotonMap.buildKdTree();
-				state = Rendering;
+				Clock::time_point begin = Clock::now();
+				Parrallel::parrallelWait(nextPass);
+				fprintf(stderr, "\r[Tracer] Waited %.1f ms for the next photon maps\n",
+					std::chrono::duration<Real, std::milli>(Clock::now() - begin).count());
+				std::swap(mGlobalMap, mNextGlobalMap);
+				std::swap(mCausticMap, mNextCausticMap);
 			}
-				break;
-			case Rendering:
+			else if (curRecurse + 1 < numRecurse)
+				preparePhotons(*mGlobalMap, *mCausticMap, curRecurse + 1);
+		}
+		closePhotonCache();
+		fprintf(stderr, "\r\n[Tracer] Rendering Done!");
+		mState = DONE;
+		u8* frame = new u8[mEndPos.x * mEndPos.y * 3];
+		s32 offset = 0;
+		for (s32 y = mEndPos.y; y-- > 0; )
+		{
+			for (s32 x = 0; x < mEndPos.x; ++x)
 			{
-				mutex.lock();
-				Point2i start = mNextStart;
-				Point2i end = mNextStart + Point2i(mTileSize, mTileSize);
-				mNextStart.x += mTileSize;
-				if (mNextStart.x >= mEndPos.x)
-				{
-					mNextStart.x = 0;
-					end.x = mEndPos.x;
-					mNextStart.y += mTileSize;
-				}
-				mutex.unlock();
-				end.y = std::min(end.y, mEndPos.y);
-				traceTile(start, end, *mSampler);
-				fprintf(stderr, "\r[Tracer] Iteration %d... %02d%%", curRecurse, int((Real)(++mJobsDone) / mJobsCount * 100));
-				if (mJobsDone >= mJobsCount)
-				{
-					fprintf(stderr, "\r[Tracer] Iteration %d... 100%%\n", curRecurse);
-					if (++curRecurse < numRecurse)
-					{
-						storedGlobalPhotons = 0;
-						storedCausticPhotons = 0;
-						globalPhotonMap.reset();
-						causticPhotonMap.reset();
-						state = Generate;
-					}
-					else
-					{
-						stopRaytracing();
-						fprintf(stderr, "\r[Tracer] Rendering Done!");
-						mState = DONE;
-						u8* frame = new u8[mEndPos.x * mEndPos.y * 3];
-						s32 offset = 0;
-						for (s32 y = mEndPos.y; y-- > 0; )
-						{
-							for (s32 x = 0; x < mEndPos.x; ++x)
-							{
-								s32 idx = x + y * mEndPos.x;
-								const SPPMPixel& p = pp[idx];
-								Spectrum c = p.Ld / numRecurse + (storedCausticPhotons > 0 ?
-									p.causticFlux / (Math::pi * p.causticRadius2 * shootCausticPhotons) : Spectrum::black) +
-									p.globalFlux / (Math::pi * p.globalRadius2 * shootGlobalPhotons);
-								frame[offset++] = (u8)255 * Math::Pow(Math::Clamp(c.r, 0.0f, 1.0f), 0.6);
-								frame[offset++] = (u8)255 * Math::Pow(Math::Clamp(c.g, 0.0f, 1.0f), 0.6);
-								frame[offset++] = (u8)255 * Math::Pow(Math::Clamp(c.b, 0.0f, 1.0f), 0.6);
-							}
-						}
-						FILE* fp = fopen(filename.c_str(), "wb");
-						(void)fprintf(fp, "P6\n%d %d\n255\n", mEndPos.x, mEndPos.y);
-						fprintf(stderr, "\n[Tracer] Saving to file: %s... ", filename.c_str());
-						fwrite(frame, 1, mEndPos.x * mEndPos.y * 3, fp);
-						fprintf(stderr, "Done!\n");
-						fclose(fp);
-						delete[] frame;
-						return;
-					}
-				}
-			}
-				break;
+				s32 idx = x + y * mEndPos.x;
+				const SPPMPixel& p = pp[idx];
+				Spectrum c = p.Ld / numRecurse + (mCausticMap->stored() > 0 ?
+					p.causticFlux / (Math::pi * p.causticRadius2 * shootCausticPhotons) : Spectrum::black) +
+					p.globalFlux / (Math::pi * p.globalRadius2 * shootGlobalPhotons);
+				frame[offset++] = (u8)255 * Math::Pow(Math::Clamp(c.r, 0.0f, 1.0f), 0.6);
+				frame[offset++] = (u8)255 * Math::Pow(Math::Clamp(c.g, 0.0f, 1.0f), 0.6);
+				frame[offset++] = (u8)255 * Math::Pow(Math::Clamp(c.b, 0.0f, 1.0f), 0.6);
 			}
 		}
+		FILE* fp = fopen(filename.c_str(), "wb");
+		(void)fprintf(fp, "P6\n%d %d\n255\n", mEndPos.x, mEndPos.y);
+		fprintf(stderr, "\n[Tracer] Saving to file: %s... ", filename.c_str());
+		fwrite(frame, 1, mEndPos.x * mEndPos.y * 3, fp);
+		fprintf(stderr, "Done!\n");
+		fclose(fp);
+		delete[] frame;
 	}
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 
 #include "TkRayTracer.h"
 #include "Photonmap.h"
+#include "sampling.h"
+#include "TkRng.h"
 
 namespace tk
 {
@@ -18,6 +20,33 @@ namespace tk
 			causticPhotons(0), globalPhotons(0) {}
 	};
 
+	// Importance of the cells of the light sample space: the light, a grid over the
+	// position sample and one over the direction sample. Learned from the importance its
+	// photons landed in, mixed with uniform emission so every cell keeps a nonzero density,
+	// and scaled by the light's power share. Cells outside the optional mask only keep a small floor.
+	class EmissionGuide
+	{
+	private:
+		s32 mNumCells;
+		s32 mPositionRes, mDirectionRes, mCellsPerLight;
+		std::vector<Real> mScore, mPaths;
+		std::vector<float> mLightPdfs;
+		std::vector<u8> mMask;
+		Distribution1D mDistribution;
+	public:
+		EmissionGuide() : mNumCells(0) {}
+		// Cells are numbered light, position x, position y, direction x, direction y
+		void init(const std::vector<float>& lightPdfs, s32 positionRes = 4, s32 directionRes = 8,
+			std::vector<u8> mask = std::vector<u8>());
+		bool active()const { return mNumCells > 0; }
+		// Picks a cell with _u_ and moves the light samples into it. Returns the cell and
+		// the density in the space of light index and samples, the light's pdf if uniform.
+		s32 sample(Real u, Vector2f* uLight0, Vector2f* uLight1, s32* lightIdx, Real* pdf)const;
+		void record(s32 cell, Real score) { mScore[cell] += score; mPaths[cell] += 1; }
+		// Rebuilds the distribution, called between photon passes
+		void update();
+	};
+
 	class SppmTracer : public RayTracer
 	{
 	protected:
@@ -28,28 +57,76 @@ namespace tk
 			Rendering
 		};
 		eSppmState state;
+		// Photon paths shot so far, path i is Halton sample i
 		s32 shootGlobalPhotons;
 		s32 shootCausticPhotons;
-		s32 storedGlobalPhotons;
-		s32 storedCausticPhotons;
 		s32 numRecurse;
 		s32 curRecurse;
 		PhotonMap globalPhotonMap;
-		PhotonMap causticPhotonMap;		
+		PhotonMap causticPhotonMap;
+		// Second pair of maps in pipelined mode, the next iteration's photons are
+		// traced into one pair while the camera pass gathers from the other
+		std::unique_ptr<PhotonMap> mSpareGlobalMap, mSpareCausticMap;
+		PhotonMap* mGlobalMap;
+		PhotonMap* mCausticMap;
+		PhotonMap* mNextGlobalMap;
+		PhotonMap* mNextCausticMap;
 		Real radius2;
+		s32 mIrradianceStride;
+		// Importance-driven emission. Importons are the camera's gather points, hashed into
+		// voxels: first diffuse hits gather caustic photons, the diffuse hits after them
+		// gather global photons.
+		bool mImportance;
+		// Caustic photons are mostly emitted into cells of the projection maps that reach
+		// mirrors or glass
+		bool mProjection;
+		bool mEmissionReady;
+		EmissionGuide mGlobalGuide, mCausticGuide;
+		std::vector<float> mGlobalImportons, mCausticImportons;
+		Real mVoxelSize;
 		std::vector<SPPMPixel> pp;
+		// Photon maps of earlier renders of the same scene, see setPhotonCache
+		std::unique_ptr<PhotonMapCache> mPhotonCache;
+		string mPhotonCacheFile;
+		u64 mPhotonCacheKey;
+		bool mPhotonCacheLoaded;
 
 		void visualize();
 		void rendering();
-		void tracePhoton(u64 haltonIdx);
-		void traceCausticPhoton(u64 haltonIdx);
+		// Traces the photon paths of one iteration and builds both kd-trees
+		void photonPass(PhotonMap& globalMap, PhotonMap& causticMap);
+		// Attaches the cached maps of _iteration_, or traces them and appends them to the cache
+		void preparePhotons(PhotonMap& globalMap, PhotonMap& causticMap, s32 iteration);
+		void openPhotonCache();
+		void closePhotonCache();
+		// Fills _map_ with whole paths in Halton index order, independent of the thread count
+		void generatePhotons(PhotonMap& map, s32* shot, u64 firstIdx, bool caustic);
+		// Starts the photon path of _haltonIdx_, returns the emission cell or -1
+		s32 emitPhoton(u64 haltonIdx, const EmissionGuide& guide, Ray* r, Spectrum* power, bool* valid)const;
+		s32 tracePhoton(u64 haltonIdx, std::vector<Photon>& photons);
+		s32 traceCausticPhoton(u64 haltonIdx, std::vector<Photon>& photons);
+		// Sets up the emission guides before the first photon pass of a render
+		void initEmission();
+		// Follows one camera path per pixel and a few diffuse bounces from its first diffuse hit
+		void traceImportons();
+		// Marks the light sample cells whose rays may hit the bounding sphere of a specular
+		// object, bounding each cell by the triangle parts it maps to and its cone of directions
+		std::vector<u8> buildProjectionMaps(s32 positionRes, s32 directionRes)const;
+		bool traceToDiffuse(Ray r, RNG& rng, Intersection* isect)const;
+		size_t voxelSlot(const std::vector<float>& importons, s32 x, s32 y, s32 z)const;
+		// Importons in the voxels a gather radius around _p_ can reach
+		float importance(const std::vector<float>& importons, const Vector3f& p)const;
 		void traceTile(Point2i start, Point2i end, Sampler& sampler);
 	public:
-		SppmTracer(s32 spp, s32 maxDepth, s32 numThreads, Real russianRoulette, SPPMParam param);
+		SppmTracer(s32 spp, s32 maxDepth, Real russianRoulette, SPPMParam param);
 		void startVisualizing();
 		void startRaytracing();
-		unsigned long updateWorkerThread(ThreadHandle* handle);
+		void updateWorkerThread(s32 threadIdx);
 		void render(string filename);
+		// The photon maps only depend on the scene and the photon settings, renders from
+		// other cameras reuse them when _sceneHash_ covers everything but the camera.
+		// Importance-steered maps depend on the view, the camera is part of their key.
+		void setPhotonCache(const string& filename, u64 sceneHash);
 	};
 }
 #endif
\ No newline at end of file
@@ -2,85 +2,105 @@
 
 namespace tk
 {
-	void neighbor_search(NearestPhotons* np, KdTree* node, s32 sampleCount)
+	void NearestPhotons::init(const Vector3f& pos, s32 count, float radius2)
 	{
-		if (!node)
-			return;
-		Photon* p = node->pt;
-		Vector3f nodePos = p->pos;
-		if (p->split < 3)
+		dstPos = pos;
+		found = 0;
+		maxCount = count;
+		maxDist2 = radius2;
+		if ((s32)dist2.size() < count)
 		{
-			float dist = np->dstPos[p->split] - nodePos[p->split];
-			if (dist > 0)
-			{
-				neighbor_search(np, node->right, sampleCount);
-				if (dist * dist < np->dist2[sampleCount])
-					neighbor_search(np, node->left, sampleCount);
-			}
-			else
-			{
-				neighbor_search(np, node->left, sampleCount);
-				if (dist * dist < np->dist2[sampleCount])
-					neighbor_search(np, node->right, sampleCount);
-			}
+			dist2.resize(count);
+			nodes.resize(count);
 		}
+	}
 
-
-		float dist2 = dotProduct(nodePos - np->dstPos, nodePos - np->dstPos);
-
-		if (dist2 < np->dist2[sampleCount])
+	void NearestPhotons::add(float d2, s32 node)
+	{
+		if (found < maxCount)
 		{
-			if (np->found < sampleCount)
-			{
-				np->dist2[np->found] = dist2;
-				np->neighbor_photons[np->found] = p;
-				np->found++;
-				if (np->found == sampleCount)
-				{
-					int half = (np->found - 2) >> 1;
-					for (int k = half; k >= 0; --k)
-					{
-						int parent = k;
-						Photon *pp = np->neighbor_photons[k];
-						float pdist2 = np->dist2[k];
-						while (parent <= half)
-						{
-							int child = 2 * parent + 1;
-							if ((child + 1) < np->found && np->dist2[child] < np->dist2[child + 1])
-								child++;
-							if (pdist2 > np->dist2[child])
-								break;
-							np->dist2[parent] = np->dist2[child];
-							np->neighbor_photons[parent] = np->neighbor_photons[child];
-							parent = child;
-						}
-						np->dist2[parent] = pdist2;
-						np->neighbor_photons[parent] = pp;
-					}
-					np->dist2[sampleCount] = np->dist2[0];
-				}
-			}
-			else
+			dist2[found] = d2;
+			nodes[found] = node;
+			if (++found < maxCount)
+				return;
+			//build the heap once it is full
+			for (s32 k = (found - 2) >> 1; k >= 0; --k)
 			{
-				//construct a heap for store the neighbor photons
-				int half = (np->found - 2) >> 1;
-				int parent = 0;
-				int child = 1;
-				while (parent <= half)
+				s32 parent = k;
+				float pdist2 = dist2[k];
+				s32 pnode = nodes[k];
+				s32 child;
+				while ((child = 2 * parent + 1) < found)
 				{
-					if ((child + 1) < np->found && np->dist2[child] < np->dist2[child + 1])
+					if (child + 1 < found && dist2[child] < dist2[child + 1])
 						child++;
-					if (dist2 > np->dist2[child])
+					if (pdist2 >= dist2[child])
 						break;
-					np->dist2[parent] = np->dist2[child];
-					np->neighbor_photons[parent] = np->neighbor_photons[child];
+					dist2[parent] = dist2[child];
+					nodes[parent] = nodes[child];
 					parent = child;
-					child += child + 1;
 				}
-				np->dist2[parent] = dist2;
-				np->neighbor_photons[parent] = p;
-				np->dist2[sampleCount] = np->dist2[0];
+				dist2[parent] = pdist2;
+				nodes[parent] = pnode;
 			}
+			maxDist2 = dist2[0];
+			return;
+		}
+		//replace the farthest photon and sift down
+		s32 parent = 0, child;
+		while ((child = 2 * parent + 1) < found)
+		{
+			if (child + 1 < found && dist2[child] < dist2[child + 1])
+				child++;
+			if (d2 >= dist2[child])
+				break;
+			dist2[parent] = dist2[child];
+			nodes[parent] = nodes[child];
+			parent = child;
+		}
+		dist2[parent] = d2;
+		nodes[parent] = node;
+		maxDist2 = dist2[0];
+	}
+
+	void neighbor_search(NearestPhotons* np, const KdTree& tree)
+	{
+		if (tree.numNodes == 0)
+			return;
+		// Pending subtrees with the squared distance to their splitting plane,
+		// a left-balanced tree of 2^31 nodes is at most 31 levels deep
+		struct Entry
+		{
+			s32 node;
+			float planeDist2;
+		} stack[64];
+		s32 top = 0;
+		stack[top++] = { 0, 0 };
+		while (top > 0)
+		{
+			const Entry e = stack[--top];
+			if (e.planeDist2 >= np->maxDist2)
+				continue;
+			s32 node = e.node;
+			float dx = tree.pos[0][node] - np->dstPos.x;
+			float dy = tree.pos[1][node] - np->dstPos.y;
+			float dz = tree.pos[2][node] - np->dstPos.z;
+			float d2 = dx * dx + dy * dy + dz * dz;
+			if (d2 < np->maxDist2)
+				np->add(d2, node);
+
+			s32 left = 2 * node + 1;
+			if (left >= tree.numNodes)
+				continue;
+			s32 axis = tree.dir[node] >> 14;
+			float dist = np->dstPos[axis] - tree.pos[axis][node];
+			s32 nearChild = dist > 0 ? left + 1 : left;
+			s32 farChild = dist > 0 ? left : left + 1;
+			// The near side is visited first, the far side only if the plane is in range
+			if (farChild < tree.numNodes)
+				stack[top++] = { farChild, dist * dist };
+			if (nearChild < tree.numNodes)
+				stack[top++] = { nearChild, 0 };
 		}
 	}
 }
\ No newline at end of file
@@ -6,35 +6,94 @@
 
 namespace tk
 {
+	// Shared-exponent RGB, 8 bit mantissas and a biased 8 bit exponent
+	inline u32 EncodeRGBE(const Spectrum& s)
+	{
+		float v = std::max(s.r, std::max(s.g, s.b));
+		if (!(v > 1e-32f))
+			return 0;
+		int e;
+		float scale = std::frexp(v, &e) * 256.f / v;
+		return u32(std::max(s.r, 0.f) * scale) | (u32(std::max(s.g, 0.f) * scale) << 8) |
+			(u32(std::max(s.b, 0.f) * scale) << 16) | (u32(e + 128) << 24);
+	}
+
+	inline Spectrum DecodeRGBE(u32 v)
+	{
+		if (v == 0)
+			return Spectrum::black;
+		float f = std::ldexp(1.f, int(v >> 24) - (128 + 8));
+		return Spectrum(((v & 0xFF) + 0.5f) * f, (((v >> 8) & 0xFF) + 0.5f) * f, (((v >> 16) & 0xFF) + 0.5f) * f);
+	}
+
+	// Octahedral unit vector in 7 bits per component, the top 2 bits are left free
+	inline u16 EncodeDirection(const Vector3f& d)
+	{
+		float l1 = std::abs(d.x) + std::abs(d.y) + std::abs(d.z);
+		float u = d.x / l1, v = d.y / l1;
+		if (d.z < 0)
+		{
+			float tu = (1 - std::abs(v)) * (u >= 0 ? 1 : -1);
+			v = (1 - std::abs(u)) * (v >= 0 ? 1 : -1);
+			u = tu;
+		}
+		u32 qu = u32(Math::Clamp((u * 0.5f + 0.5f) * 127 + 0.5f, 0.f, 127.f));
+		u32 qv = u32(Math::Clamp((v * 0.5f + 0.5f) * 127 + 0.5f, 0.f, 127.f));
+		return u16(qu | (qv << 7));
+	}
+
+	inline Vector3f DecodeDirection(u16 bits)
+	{
+		float u = (bits & 0x7F) / 127.f * 2 - 1;
+		float v = ((bits >> 7) & 0x7F) / 127.f * 2 - 1;
+		Vector3f d(u, v, 1 - std::abs(u) - std::abs(v));
+		if (d.z < 0)
+		{
+			d.x = (1 - std::abs(v)) * (u >= 0 ? 1 : -1);
+			d.y = (1 - std::abs(u)) * (v >= 0 ? 1 : -1);
+		}
+		return normalize(d);
+	}
+
+	// 20 bytes, _dir_ points back along the incoming path, _normal_ is the surface normal
 	struct Photon
 	{
 		Vector3f pos;
-		Spectrum power;
-		u8 theta, phi;
-		s16 split = 4;
+		u32 power;
+		u16 dir;
+		u16 normal;
 		Photon() {}
-		Photon(Vector3f pos, Spectrum power, u8 theta, u8 phi)
-			: pos(pos), power(power), theta(theta), phi(phi) {}
+		Photon(const Vector3f& pos, const Spectrum& power, const Vector3f& dir, const Vector3f& normal)
+			: pos(pos), power(EncodeRGBE(power)), dir(EncodeDirection(dir)), normal(EncodeDirection(normal)) {}
 	};
 
+	// Nodes of a left-balanced kd-tree stored as arrays, node i has children 2i+1 and 2i+2.
+	// The split axis is kept in the top 2 bits of the photon direction.
 	struct KdTree
 	{
-		Photon* pt;
-		KdTree* left;
-		KdTree* right;
-		KdTree() : pt(0), left(0), right(0) {}
+		const float* pos[3];
+		const u32* power;
+		const u16* dir;
+		const u16* normal;
+		s32 numNodes;
 	};
 
+	// Max-heap of the k nearest nodes found so far, reused across queries
 	struct NearestPhotons
 	{
 	public:
-		s32 found;
+		s32 found, maxCount;
 		Vector3f dstPos;
-		float *dist2;
-		std::vector<Photon*> neighbor_photons;
+		// Squared radius of the search, the farthest photon once the heap is full
+		float maxDist2;
+		std::vector<float> dist2;
+		std::vector<s32> nodes;
+
+		void init(const Vector3f& pos, s32 count, float radius2);
+		void add(float d2, s32 node);
 	};
 
-	void neighbor_search(NearestPhotons* np, KdTree* node, s32 sampleCount);
+	void neighbor_search(NearestPhotons* np, const KdTree& tree);
 }
 
 #endif
\ No newline at end of file